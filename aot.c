@@ -0,0 +1,103 @@
+#include "aot.h"
+#include <stdlib.h>
+#include <string.h>
+#include "chip8machine.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+typedef struct AotState {
+    const AotProgram* program;
+    // One flag per block, set while its bytes differ from the ROM
+    uint8_t* stale;
+} AotState;
+
+static int block_stale(const Chip8* chip8,
+                       const AotProgram* program,
+                       const AotBlock* block) {
+    return memcmp(chip8->mem + block->start,
+                  program->rom + (block->start - 0x200),
+                  block->end - block->start) != 0;
+}
+
+static int program_matches(const Chip8* chip8, const AotProgram* program) {
+    // Only the translated code has to match; data in the ROM is read from
+    // memory like any other core does
+    if (program->num_blocks == 0)
+        return FALSE;
+    for (unsigned int i = 0; i < program->num_blocks; i++) {
+        if (block_stale(chip8, program, &program->blocks[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+int aot_attach(Chip8* chip8,
+               const AotProgram* const* programs,
+               unsigned int num_programs) {
+    aot_free(chip8);
+    for (unsigned int i = 0; i < num_programs; i++) {
+        if (!program_matches(chip8, programs[i]))
+            continue;
+
+        AotState* state = malloc(sizeof(AotState));
+        uint8_t* stale = calloc(programs[i]->num_blocks, sizeof(uint8_t));
+        if (!state || !stale) {
+            free(state);
+            free(stale);
+            return FALSE;
+        }
+        state->program = programs[i];
+        state->stale = stale;
+        chip8->aot = state;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void run_aot(Chip8* chip8, unsigned long cycles) {
+    AotState* state = chip8->aot;
+    if (!state) {
+        run_cached(chip8, cycles);
+        return;
+    }
+
+    while (cycles > 0) {
+        unsigned long left = state->program->run(chip8, state->stale, cycles);
+        if (left == cycles) {
+            // Not translated, stale or longer than the budget: interpret a
+            // single instruction and try again from the next one
+            run_cached(chip8, 1);
+            left--;
+        }
+        cycles = left;
+    }
+}
+
+void aot_invalidate(Chip8* chip8, unsigned int addr, unsigned int num_bytes) {
+    AotState* state = chip8->aot;
+    if (!state)
+        return;
+
+    // Blocks are checked against the ROM rather than just dropped, so a
+    // write of the bytes already there, or a restore of the original code,
+    // leaves them running natively
+    const AotProgram* program = state->program;
+    unsigned int end = addr + num_bytes;
+    for (unsigned int i = 0; i < program->num_blocks; i++) {
+        const AotBlock* block = &program->blocks[i];
+        if (block->start >= end)
+            break;
+        if (block->end > addr)
+            state->stale[i] = block_stale(chip8, program, block);
+    }
+}
+
+void aot_free(Chip8* chip8) {
+    AotState* state = chip8->aot;
+    if (!state)
+        return;
+    free(state->stale);
+    free(state);
+    chip8->aot = NULL;
+}
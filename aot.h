@@ -0,0 +1,50 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+
+struct Chip8;
+
+// A run of instructions translated as one unit, entered only at start
+typedef struct {
+    uint16_t start;
+    // One past the last byte of its last instruction
+    uint16_t end;
+} AotBlock;
+
+// A ROM translated to C ahead of time by chip8_aot. Blocks are sorted by
+// start address.
+typedef struct AotProgram {
+    const char* name;
+    // The ROM the translation was made from, loaded at 0x200
+    const unsigned char* rom;
+    unsigned int size;
+    const AotBlock* blocks;
+    unsigned int num_blocks;
+    // Runs translated blocks from pc while it can, skipping any block marked
+    // stale. Returns the cycles left once the next instruction has to be
+    // interpreted, or the budget is shorter than the next block.
+    unsigned long (*run)(struct Chip8* chip8,
+                         const uint8_t* stale,
+                         unsigned long cycles);
+} AotProgram;
+
+// Programs linked into the executable, generated from CHIP8_AOT_ROMS
+extern const AotProgram* const aot_programs[];
+extern const unsigned int num_aot_programs;
+
+// Picks the program whose translated code is what the machine holds and
+// runs it from then on. Returns FALSE, leaving the machine on the cached
+// interpreter, if none matches or there is no memory.
+int aot_attach(struct Chip8* chip8,
+               const AotProgram* const* programs,
+               unsigned int num_programs);
+// Runs translated code where it is still valid, the cached interpreter
+// everywhere else
+void run_aot(struct Chip8* chip8, unsigned long cycles);
+void aot_invalidate(struct Chip8* chip8,
+                    unsigned int addr,
+                    unsigned int num_bytes);
+void aot_free(struct Chip8* chip8);
+
+#endif
@@ -0,0 +1,499 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aot.h"
+#include "chip8machine.h"
+#include "romcache.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define MAX_NAME 64
+#define ROM_BYTES_PER_LINE 12
+
+// Static recompiler: follows the control flow of a ROM from 0x200 and writes
+// a C translation unit with one goto label per basic block, for the aot core
+// to run. Instructions are classified by the same decoder the cached core
+// uses. Anything reached only at runtime is left to the interpreter.
+
+typedef struct {
+    Chip8* chip8;
+    const CachedRom* rom;
+    DecodedInstr decoded[RAM_SIZE];
+    // Address has been queued, whether or not it can be translated
+    uint8_t visited[RAM_SIZE];
+    // Instruction at the address is part of the translation
+    uint8_t translated[RAM_SIZE];
+    // Starts a block: entry point, branch target, or return address
+    uint8_t leader[RAM_SIZE];
+    uint16_t worklist[RAM_SIZE];
+    unsigned int num_work;
+    AotBlock blocks[RAM_SIZE];
+    unsigned int num_blocks;
+    unsigned int num_instructions;
+    unsigned int num_untranslated;
+    // Whether run() needs the locals and entry label these use
+    int has_ret;
+    int has_add_reg;
+} Translator;
+
+static uint16_t opcode_at(Translator* t, unsigned int addr) {
+    return (uint16_t)t->chip8->mem[addr] << 8 | t->chip8->mem[addr + 1];
+}
+
+static const DecodedInstr* instr_at(Translator* t, unsigned int addr) {
+    icache_decode(opcode_at(t, addr), &t->decoded[addr]);
+    return &t->decoded[addr];
+}
+
+static int in_rom(Translator* t, unsigned int addr) {
+    return addr >= 0x200 && addr + 2 <= 0x200 + t->rom->size;
+}
+
+static int is_translatable(const DecodedInstr* d) {
+    if (d->op == OP_UNHANDLED)
+        return FALSE;
+    if (d->op == OP_KEY)
+        return d->nn == 0x9E || d->nn == 0xA1;
+    return TRUE;
+}
+
+static int is_skip(const DecodedInstr* d) {
+    return d->op == OP_SE_IMM || d->op == OP_SNE_IMM || d->op == OP_SE_REG ||
+           d->op == OP_SNE_REG || d->op == OP_KEY;
+}
+
+static int is_store(const DecodedInstr* d) {
+    return d->op == OP_MISC && (d->nn == 0x33 || d->nn == 0x55);
+}
+
+static int is_key_wait(const DecodedInstr* d) {
+    return d->op == OP_MISC && d->nn == 0x0A;
+}
+
+static int ends_block(const DecodedInstr* d) {
+    // Stores end a block too, so the code after them is checked again
+    return d->op == OP_JP || d->op == OP_CALL || d->op == OP_RET ||
+           is_skip(d) || is_key_wait(d) || is_store(d);
+}
+
+static void reach(Translator* t, unsigned int addr, int leader) {
+    if (!in_rom(t, addr))
+        return;
+    if (leader)
+        t->leader[addr] = TRUE;
+    if (t->visited[addr])
+        return;
+    t->visited[addr] = TRUE;
+    t->worklist[t->num_work++] = addr;
+}
+
+static void analyse(Translator* t) {
+    reach(t, 0x200, TRUE);
+    while (t->num_work > 0) {
+        unsigned int addr = t->worklist[--t->num_work];
+        const DecodedInstr* d = instr_at(t, addr);
+
+        if (!is_translatable(d)) {
+            // Interpreted; translation picks up again after it
+            t->num_untranslated++;
+            reach(t, addr + 2, TRUE);
+            continue;
+        }
+        t->translated[addr] = TRUE;
+        t->num_instructions++;
+        t->has_ret |= d->op == OP_RET;
+        t->has_add_reg |= d->op == OP_ADD_REG;
+        switch (d->op) {
+            case OP_JP:
+                reach(t, d->nnn, TRUE);
+                break;
+            case OP_CALL:
+                reach(t, d->nnn, TRUE);
+                reach(t, addr + 2, TRUE);
+                break;
+            case OP_RET:
+                // Returns land on the addresses after the calls
+                break;
+            default:
+                if (is_skip(d)) {
+                    reach(t, addr + 2, TRUE);
+                    reach(t, addr + 4, TRUE);
+                } else if (is_key_wait(d)) {
+                    // Loops on itself until a key is held
+                    t->leader[addr] = TRUE;
+                    reach(t, addr + 2, TRUE);
+                } else {
+                    reach(t, addr + 2, is_store(d));
+                }
+                break;
+        }
+    }
+
+    // Split into blocks, each running from a leader until a control transfer
+    // or the next leader
+    for (unsigned int addr = 0x200; addr < RAM_SIZE; addr++) {
+        if (!t->translated[addr] || !t->leader[addr])
+            continue;
+        unsigned int end = addr;
+        do {
+            end += 2;
+        } while (!ends_block(instr_at(t, end - 2)) && end < RAM_SIZE &&
+                 t->translated[end] && !t->leader[end]);
+        t->blocks[t->num_blocks].start = addr;
+        t->blocks[t->num_blocks].end = end;
+        t->num_blocks++;
+    }
+}
+
+static int is_block_start(Translator* t, unsigned int addr) {
+    return addr < RAM_SIZE && t->translated[addr] && t->leader[addr];
+}
+
+static void emit_transfer(Translator* t,
+                          FILE* out,
+                          const char* indent,
+                          unsigned int target) {
+    if (is_block_start(t, target)) {
+        fprintf(out, "%sgoto a%03X;\n", indent, target);
+    } else {
+        fprintf(out, "%schip8->pc = 0x%03X;\n", indent, target);
+        fprintf(out, "%sreturn cycles;\n", indent);
+    }
+}
+
+static void emit_branch(Translator* t,
+                        FILE* out,
+                        const char* condition,
+                        unsigned int addr) {
+    fprintf(out, "    if (%s) {\n", condition);
+    emit_transfer(t, out, "        ", addr + 4);
+    fprintf(out, "%s\n", "    }");
+    emit_transfer(t, out, "    ", addr + 2);
+}
+
+static void emit_fault_check(FILE* out, unsigned int addr, unsigned int rest) {
+    // The handler backs pc up to the instruction when it faults; the
+    // instructions after it in the block were charged but never ran
+    fprintf(out, "    if (chip8->pc == 0x%03X)\n", addr);
+    fprintf(out, "        return cycles + %u;\n", rest);
+}
+
+static void emit_instruction(Translator* t,
+                             FILE* out,
+                             unsigned int addr,
+                             unsigned int rest) {
+    const DecodedInstr* d = instr_at(t, addr);
+    char condition[64];
+
+    fprintf(out, "    // %03X: %04X\n", addr, opcode_at(t, addr));
+    switch (d->op) {
+        case OP_NOP:
+            break;
+        case OP_CLS:
+            fprintf(out, "%s\n", "    clear_screen(chip8);");
+            break;
+        case OP_RET:
+            fprintf(out, "    chip8->pc = 0x%03X;\n", addr + 2);
+            fprintf(out, "%s\n",
+                    "    if (!stack_pop(&chip8->stack, &ret)) {\n"
+                    "        raise_fault(chip8, FAULT_STACK_UNDERFLOW);\n"
+                    "        return cycles;\n"
+                    "    }\n"
+                    "    chip8->pc = ret;\n"
+                    "    goto enter;");
+            break;
+        case OP_JP:
+            emit_transfer(t, out, "    ", d->nnn);
+            break;
+        case OP_CALL:
+            fprintf(out, "    chip8->pc = 0x%03X;\n", addr + 2);
+            fprintf(out, "%s\n",
+                    "    if (!stack_push(&chip8->stack, chip8->pc)) {\n"
+                    "        raise_fault(chip8, FAULT_STACK_OVERFLOW);\n"
+                    "        return cycles;\n"
+                    "    }");
+            emit_transfer(t, out, "    ", d->nnn);
+            break;
+        case OP_SE_IMM:
+        case OP_SNE_IMM:
+            snprintf(condition, sizeof(condition), "chip8->v[%u] %s 0x%02X",
+                     d->x, d->op == OP_SE_IMM ? "==" : "!=", d->nn);
+            emit_branch(t, out, condition, addr);
+            break;
+        case OP_SE_REG:
+        case OP_SNE_REG:
+            snprintf(condition, sizeof(condition),
+                     "chip8->v[%u] %s chip8->v[%u]", d->x,
+                     d->op == OP_SE_REG ? "==" : "!=", d->y);
+            emit_branch(t, out, condition, addr);
+            break;
+        case OP_KEY:
+            snprintf(condition, sizeof(condition),
+                     "%s((chip8->keypad >> (chip8->v[%u] & 0xF)) & 1)",
+                     d->nn == 0x9E ? "" : "!", d->x);
+            emit_branch(t, out, condition, addr);
+            break;
+        case OP_LD_IMM:
+            fprintf(out, "    chip8->v[%u] = 0x%02X;\n", d->x, d->nn);
+            break;
+        case OP_ADD_IMM:
+            fprintf(out, "    chip8->v[%u] += 0x%02X;\n", d->x, d->nn);
+            break;
+        case OP_LD_REG:
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR: {
+            static const char* const ops[] = {"=", "|=", "&=", "^="};
+            fprintf(out, "    chip8->v[%u] %s chip8->v[%u];\n", d->x,
+                    ops[d->op - OP_LD_REG], d->y);
+            break;
+        }
+        case OP_ADD_REG:
+            fprintf(out,
+                    "    sum = chip8->v[%u] + chip8->v[%u];\n"
+                    "    chip8->v[0xF] = sum > 255;\n"
+                    "    chip8->v[%u] = sum;\n",
+                    d->x, d->y, d->x);
+            break;
+        case OP_ALU:
+            // Subtractions and shifts keep going through the shared handler
+            fprintf(out, "    instruction8_handler(%u, %u, %u, chip8);\n", d->x,
+                    d->y, d->n);
+            break;
+        case OP_LD_I:
+            fprintf(out, "    chip8->I = 0x%03X;\n", d->nnn);
+            break;
+        case OP_JP_V0:
+            fprintf(out, "    chip8->I = 0x%03X + chip8->v[0];\n", d->nnn);
+            break;
+        case OP_RND:
+            fprintf(out, "    random_register(chip8, %u, 0x%02X);\n", d->x,
+                    d->nn);
+            break;
+        case OP_DRW:
+            fprintf(out, "    chip8->pc = 0x%03X;\n", addr + 2);
+            fprintf(out, "    draw_sprite(chip8, %u, %u, %u);\n", d->x, d->y,
+                    d->n);
+            emit_fault_check(out, addr, rest);
+            break;
+        case OP_ADD_I:
+            fprintf(out, "    chip8->I += chip8->v[%u];\n", d->x);
+            break;
+        case OP_MISC:
+            if (d->nn == 0x07) {
+                fprintf(out, "    chip8->v[%u] = read_delay_timer(chip8);\n",
+                        d->x);
+            } else if (d->nn == 0x15) {
+                fprintf(out, "    set_delay_timer(chip8, chip8->v[%u]);\n",
+                        d->x);
+            } else if (d->nn == 0x18) {
+                fprintf(out, "    set_sound_timer(chip8, chip8->v[%u]);\n",
+                        d->x);
+            } else if (d->nn == 0x0A) {
+                fprintf(out, "%s\n", "    if (chip8->keypad == 0)");
+                fprintf(out, "        goto a%03X;\n", addr);
+                fprintf(out, "    instructionF_handler(%u, 0x0A, chip8);\n",
+                        d->x);
+                emit_transfer(t, out, "    ", addr + 2);
+            } else {
+                fprintf(out, "    chip8->pc = 0x%03X;\n", addr + 2);
+                fprintf(out, "    instructionF_handler(%u, 0x%02X, chip8);\n",
+                        d->x, d->nn);
+                emit_fault_check(out, addr, rest);
+                if (is_store(d))
+                    emit_transfer(t, out, "    ", addr + 2);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void emit_block(Translator* t,
+                       FILE* out,
+                       unsigned int index,
+                       const AotBlock* block) {
+    unsigned int length = (block->end - block->start) / 2;
+
+    // Charged up front; a budget too short for the whole block is left to
+    // the interpreter
+    fprintf(out, "a%03X:\n", block->start);
+    fprintf(out, "    if (stale[%u] || cycles < %u) {\n", index, length);
+    fprintf(out, "        chip8->pc = 0x%03X;\n", block->start);
+    fprintf(out, "%s\n", "        return cycles;\n    }");
+    fprintf(out, "    cycles -= %u;\n", length);
+    for (unsigned int addr = block->start; addr < block->end; addr += 2) {
+        emit_instruction(t, out, addr, (block->end - addr) / 2 - 1);
+    }
+    if (!ends_block(instr_at(t, block->end - 2)))
+        emit_transfer(t, out, "    ", block->end);
+    fprintf(out, "%s\n", "");
+}
+
+static const char* base_name(const char* file_name) {
+    const char* base = strrchr(file_name, '/');
+    return base ? base + 1 : file_name;
+}
+
+static void emit_program(Translator* t,
+                         FILE* out,
+                         const char* rom_file_name,
+                         const char* name) {
+    fprintf(out, "// Generated by chip8_aot from %s. Do not edit.\n",
+            base_name(rom_file_name));
+    fprintf(out, "%s\n\n", "#include \"aot.h\"\n#include \"chip8machine.h\"");
+
+    fprintf(out, "%s\n", "static const unsigned char rom[] = {");
+    for (size_t i = 0; i < t->rom->size; i++) {
+        if (i % ROM_BYTES_PER_LINE == 0)
+            fprintf(out, "%s", "   ");
+        fprintf(out, " 0x%02X,", t->rom->data[i]);
+        if (i % ROM_BYTES_PER_LINE == ROM_BYTES_PER_LINE - 1 ||
+            i + 1 == t->rom->size)
+            fprintf(out, "%s\n", "");
+    }
+    if (t->rom->size == 0)
+        fprintf(out, "%s\n", "    0x00,");
+    fprintf(out, "%s\n\n", "};");
+
+    fprintf(out, "%s\n", "static const AotBlock blocks[] = {");
+    for (unsigned int i = 0; i < t->num_blocks; i++) {
+        fprintf(out, "    {0x%03X, 0x%03X},\n", t->blocks[i].start,
+                t->blocks[i].end);
+    }
+    if (t->num_blocks == 0)
+        fprintf(out, "%s\n", "    {0, 0},");
+    fprintf(out, "%s\n\n", "};");
+
+    fprintf(out, "%s\n",
+            "static unsigned long run(Chip8* chip8,\n"
+            "                         const uint8_t* stale,\n"
+            "                         unsigned long cycles) {");
+    if (t->has_ret)
+        fprintf(out, "%s\n", "    uint16_t ret;");
+    if (t->has_add_reg)
+        fprintf(out, "%s\n", "    uint16_t sum;");
+    if (t->num_blocks == 0)
+        fprintf(out, "%s\n", "    (void)stale;");
+    fprintf(out, "%s\n", "");
+    if (t->has_ret)
+        fprintf(out, "%s\n", "enter:");
+    fprintf(out, "%s\n", "    switch (chip8->pc) {");
+    for (unsigned int i = 0; i < t->num_blocks; i++) {
+        fprintf(out, "        case 0x%03X:\n", t->blocks[i].start);
+        fprintf(out, "            goto a%03X;\n", t->blocks[i].start);
+    }
+    fprintf(out, "%s\n\n",
+            "        default:\n"
+            "            return cycles;\n"
+            "    }");
+    for (unsigned int i = 0; i < t->num_blocks; i++) {
+        emit_block(t, out, i, &t->blocks[i]);
+    }
+    fprintf(out, "%s\n\n", "}");
+
+    fprintf(out, "const AotProgram aot_%s = {\n", name);
+    fprintf(out, "    \"%s\", rom, %zu, blocks, %u, run,\n", name,
+            t->rom->size, t->num_blocks);
+    fprintf(out, "%s\n", "};");
+}
+
+static void default_name(const char* rom_file_name, char* name) {
+    // File name without directory or extension, as a C identifier
+    const char* base = base_name(rom_file_name);
+    unsigned int len = 0;
+    while (base[len] && base[len] != '.' && len < MAX_NAME - 1) {
+        name[len] = isalnum((unsigned char)base[len]) ? base[len] : '_';
+        len++;
+    }
+    name[len] = '\0';
+}
+
+static int valid_name(const char* name) {
+    if (!name[0] || isdigit((unsigned char)name[0]))
+        return FALSE;
+    for (const char* c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_')
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void usage(const char* program) {
+    printf("Usage: %s [-n name] rom out.c\n", program);
+    printf("%s\n",
+           "  -n name    program name, exported as aot_<name> (default: the "
+           "rom's file name)");
+}
+
+int main(int argc, char** argv) {
+    char name[MAX_NAME] = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                snprintf(name, sizeof(name), "%s", optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* rom_file_name = argv[optind];
+    const char* out_file_name = argv[optind + 1];
+    if (!name[0])
+        default_name(rom_file_name, name);
+    if (!valid_name(name)) {
+        printf("Not a C identifier: %s\n", name);
+        return 1;
+    }
+
+    RomCache cache;
+    Translator* t = calloc(1, sizeof(Translator));
+    if (!t) {
+        printf("%s\n", "Failed to allocate memory for translator. Exiting.");
+        exit(-1);
+    }
+    rom_cache_init(&cache);
+    Chip8Status status = rom_cache_get(&cache, rom_file_name, &t->rom);
+    t->chip8 = status == CHIP8_OK ? init_machine() : NULL;
+    if (status != CHIP8_OK || !t->chip8) {
+        printf("%s: %s\n", rom_file_name, chip8_status_name(status));
+        return 1;
+    }
+    load_cached_rom(t->chip8, t->rom);
+
+    analyse(t);
+
+    FILE* out = fopen(out_file_name, "w");
+    if (!out) {
+        printf("Cannot write %s\n", out_file_name);
+        return 1;
+    }
+    emit_program(t, out, rom_file_name, name);
+    if (fclose(out) != 0) {
+        printf("Cannot write %s\n", out_file_name);
+        remove(out_file_name);
+        return 1;
+    }
+    printf("%s: %u instructions in %u blocks, %u left to the interpreter\n",
+           rom_file_name, t->num_instructions, t->num_blocks,
+           t->num_untranslated);
+
+    free_machine(t->chip8);
+    rom_cache_free(&cache);
+    free(t);
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include "batch.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "aot.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// Double-ended queue of job indices. The owning worker pushes and pops at
+// the tail, thieves take from the head.
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int* items;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+} JobQueue;
+
+typedef struct BatchEngine BatchEngine;
+
+typedef struct {
+    BatchEngine* engine;
+    unsigned int index;
+    pthread_t thread;
+} Worker;
+
+struct BatchEngine {
+    BatchJob* jobs;
+    Chip8** machines;
+    JobQueue* queues;
+    Worker* workers;
+    unsigned int num_threads;
+    Chip8Core core;
+    unsigned long quantum;
+    // Jobs that have not halted yet
+    unsigned int unfinished;
+    pthread_mutex_t unfinished_lock;
+};
+
+static void queue_init(JobQueue* queue, unsigned int capacity) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->items = malloc(capacity * sizeof(unsigned int));
+    if (!queue->items) {
+        printf("%s\n", "Failed to allocate memory for job queue. Exiting.");
+        exit(-1);
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+}
+
+static void queue_free(JobQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+}
+
+static void queue_push(JobQueue* queue, unsigned int job) {
+    pthread_mutex_lock(&queue->lock);
+    queue->items[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int queue_pop(JobQueue* queue, unsigned int* job) {
+    int found = FALSE;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        *job = queue->items[(queue->head + queue->count) % queue->capacity];
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static int queue_steal(JobQueue* queue, unsigned int* job) {
+    int found = FALSE;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        *job = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static int jobs_left(BatchEngine* engine) {
+    pthread_mutex_lock(&engine->unfinished_lock);
+    int left = engine->unfinished > 0;
+    pthread_mutex_unlock(&engine->unfinished_lock);
+    return left;
+}
+
+static void finish_job(BatchEngine* engine, unsigned int index) {
+    BatchJob* job = &engine->jobs[index];
+    Chip8* chip8 = engine->machines[index];
+
+    // A job that failed to load never got a machine
+    if (chip8) {
+        job->state_hash = hash_machine(chip8);
+        free_machine(chip8);
+    }
+    engine->machines[index] = NULL;
+
+    pthread_mutex_lock(&engine->unfinished_lock);
+    engine->unfinished--;
+    pthread_mutex_unlock(&engine->unfinished_lock);
+}
+
+// Runs one quantum of a job. Returns FALSE once the job has halted.
+static int step_job(BatchEngine* engine, unsigned int index) {
+    BatchJob* job = &engine->jobs[index];
+    Chip8* chip8 = engine->machines[index];
+
+    if (!chip8) {
+        // Created on the worker that first runs it
+        chip8 = init_machine();
+        if (!chip8) {
+            job->halt_reason = HALT_LOAD_ERROR;
+            finish_job(engine, index);
+            return FALSE;
+        }
+        load_cached_rom(chip8, job->rom);
+        if (engine->core == CORE_AOT)
+            aot_attach(chip8, aot_programs, num_aot_programs);
+        engine->machines[index] = chip8;
+    }
+
+    unsigned long slice = job->max_cycles - job->cycles;
+    if (slice > engine->quantum)
+        slice = engine->quantum;
+    run_cycles(chip8, engine->core, slice);
+    job->cycles += slice;
+
+    if (chip8->fault != FAULT_NONE) {
+        job->halt_reason = HALT_FAULT;
+    } else if (detect_stuck(chip8)) {
+        job->halt_reason = HALT_STUCK;
+    } else if (job->cycles >= job->max_cycles) {
+        job->halt_reason = HALT_BUDGET;
+    } else {
+        return TRUE;
+    }
+    finish_job(engine, index);
+    return FALSE;
+}
+
+static int find_job(BatchEngine* engine, unsigned int self, unsigned int* job) {
+    if (queue_pop(&engine->queues[self], job))
+        return TRUE;
+    for (unsigned int i = 1; i < engine->num_threads; i++) {
+        unsigned int victim = (self + i) % engine->num_threads;
+        if (queue_steal(&engine->queues[victim], job))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    BatchEngine* engine = worker->engine;
+    unsigned int job;
+
+    while (jobs_left(engine)) {
+        if (!find_job(engine, worker->index, &job)) {
+            // Everything left is in flight on other workers
+            sched_yield();
+            continue;
+        }
+        if (step_job(engine, job))
+            queue_push(&engine->queues[worker->index], job);
+    }
+    return NULL;
+}
+
+void run_batch(BatchJob* jobs,
+               unsigned int num_jobs,
+               unsigned int num_threads,
+               Chip8Core core,
+               unsigned long quantum) {
+    BatchEngine engine;
+
+    if (num_threads == 0)
+        num_threads = 1;
+    engine.jobs = jobs;
+    engine.num_threads = num_threads;
+    engine.core = core;
+    engine.quantum = quantum;
+    engine.unfinished = num_jobs;
+    pthread_mutex_init(&engine.unfinished_lock, NULL);
+    engine.machines = calloc(num_jobs, sizeof(Chip8*));
+    engine.queues = calloc(num_threads, sizeof(JobQueue));
+    engine.workers = calloc(num_threads, sizeof(Worker));
+    if (!engine.machines || !engine.queues || !engine.workers) {
+        printf("%s\n", "Failed to allocate memory for batch. Exiting.");
+        exit(-1);
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        queue_init(&engine.queues[i], num_jobs);
+    }
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        jobs[i].cycles = 0;
+        jobs[i].halt_reason = HALT_NONE;
+        queue_push(&engine.queues[i % num_threads], i);
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        engine.workers[i].engine = &engine;
+        engine.workers[i].index = i;
+        if (pthread_create(&engine.workers[i].thread, NULL, worker_main,
+                           &engine.workers[i]) != 0) {
+            printf("%s\n", "Failed to start worker thread. Exiting.");
+            exit(-1);
+        }
+    }
+    for (unsigned int i = 0; i < num_threads; i++) {
+        pthread_join(engine.workers[i].thread, NULL);
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        queue_free(&engine.queues[i]);
+    }
+    pthread_mutex_destroy(&engine.unfinished_lock);
+    free(engine.workers);
+    free(engine.queues);
+    free(engine.machines);
+}
+
+const char* halt_reason_name(HaltReason reason) {
+    switch (reason) {
+        case HALT_BUDGET:
+            return "budget";
+        case HALT_STUCK:
+            return "stuck";
+        case HALT_FAULT:
+            return "fault";
+        case HALT_LOAD_ERROR:
+            return "load error";
+        default:
+            return "none";
+    }
+}
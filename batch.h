@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "chip8machine.h"
+#include "romcache.h"
+
+// Cycles a machine runs before its worker moves on to the next one
+#define BATCH_QUANTUM 10000
+
+typedef enum {
+    HALT_NONE,
+    // Ran for the whole cycle budget
+    HALT_BUDGET,
+    // Parked on a jump to its own address
+    HALT_STUCK,
+    // Stopped on a guest fault
+    HALT_FAULT,
+    // No memory for the machine
+    HALT_LOAD_ERROR,
+} HaltReason;
+
+typedef struct {
+    // Filled in by the caller
+    const CachedRom* rom;
+    unsigned long max_cycles;
+    // Filled in by run_batch()
+    uint64_t state_hash;
+    unsigned long cycles;
+    HaltReason halt_reason;
+} BatchJob;
+
+// Runs every job to completion on num_threads workers. Each worker steps the
+// machines in its own queue for quantum cycles at a time and steals from the
+// other queues once its own is empty.
+void run_batch(BatchJob* jobs,
+               unsigned int num_jobs,
+               unsigned int num_threads,
+               Chip8Core core,
+               unsigned long quantum);
+
+const char* halt_reason_name(HaltReason reason);
+
+#endif
@@ -0,0 +1,456 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chip8machine.h"
+#include "optable.h"
+#include "renderer.h"
+#include "romcache.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define DEFAULT_REPETITIONS 21
+#define DEFAULT_WARMUP 3
+#define DEFAULT_OPS 100000
+// Synthetic streams are this long and replayed, so generating them stays out
+// of the timed loop
+#define STREAM_SIZE 4096
+
+typedef enum { FORMAT_CSV, FORMAT_JSON } OutputFormat;
+
+typedef struct {
+    Chip8* chip8;
+    Renderer* renderer;
+    uint16_t instructions[STREAM_SIZE];
+    uint8_t operands[STREAM_SIZE][3];
+    uint64_t rows[STREAM_SIZE];
+    // A full-size ROM on disk and in the cache, for the startup benchmarks
+    char rom_path[32];
+    RomCache rom_cache;
+    const CachedRom* rom;
+} BenchContext;
+
+typedef struct {
+    const char* name;
+    void (*setup)(BenchContext* ctx);
+    void (*run)(BenchContext* ctx, unsigned long ops);
+    // Divides the op count, for benchmarks that cost far more than the rest
+    unsigned long ops_divisor;
+} Benchmark;
+
+typedef struct {
+    unsigned long ops;
+    unsigned int repetitions;
+    double median_ns;
+    double p99_ns;
+    double min_ns;
+} BenchResult;
+
+// Keeps results alive so the calls being timed are not optimised away
+static volatile uint64_t sink;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t bench_random(void) {
+    // xorshift64, fixed seed so every run times the same streams
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void reset_machine(BenchContext* ctx) {
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned int addr = 0x200; addr < RAM_SIZE; addr++) {
+        chip8->mem[addr] = bench_random();
+    }
+    invalidate_code(chip8, 0x200, RAM_SIZE - 0x200);
+    for (unsigned int r = 0; r < 16; r++) {
+        chip8->v[r] = bench_random();
+    }
+    chip8->pc = 0x200;
+    chip8->I = 0x300;
+}
+
+static uint16_t random_instruction(void) {
+    // Opcodes that leave the machine in a state the next one can run from:
+    // I stays inside RAM so FX33/FX55/FX65 stay in bounds
+    for (;;) {
+        uint16_t instruction = bench_random();
+        switch (instruction >> 12) {
+            case 0x0:
+                return bench_random() & 1 ? 0x00E0 : 0x00EE;
+            case 0x8:
+                if ((instruction & 0xF) <= 0x7 || (instruction & 0xF) == 0xE)
+                    return instruction;
+                break;
+            case 0xA:
+            case 0xB:
+                return (instruction & 0xF000) |
+                       (0x200 + bench_random() % 0xC00);
+            case 0xE:
+                break;
+            case 0xF: {
+                static const uint8_t misc[] = {0x07, 0x15, 0x18, 0x33,
+                                               0x55, 0x65};
+                return (instruction & 0x0F00) | 0xF000 |
+                       misc[bench_random() % sizeof(misc)];
+            }
+            default:
+                return instruction;
+        }
+    }
+}
+
+static void setup_fetch(BenchContext* ctx) {
+    reset_machine(ctx);
+}
+
+static void run_fetch(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    uint64_t sum = 0;
+    for (unsigned long i = 0; i < ops; i++) {
+        chip8->pc = 0x200 + (i * 2 & 0x7FE);
+        sum += fetch(chip8);
+    }
+    sink = sum;
+}
+
+static void setup_decode(BenchContext* ctx) {
+    reset_machine(ctx);
+    for (unsigned int i = 0; i < STREAM_SIZE; i++) {
+        ctx->instructions[i] = random_instruction();
+    }
+}
+
+static void run_decode(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned long i = 0; i < ops; i++) {
+        decode(ctx->instructions[i % STREAM_SIZE], chip8);
+        // Keep I where FX33/FX55/FX65 stay inside RAM
+        chip8->I &= 0x0FFF;
+        if (chip8->I > RAM_SIZE - 16)
+            chip8->I = 0x300;
+    }
+    sink = chip8->pc;
+}
+
+static void run_decode_table(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    const OpcodeHandler* handlers = opcode_table();
+    for (unsigned long i = 0; i < ops; i++) {
+        uint16_t instruction = ctx->instructions[i % STREAM_SIZE];
+        handlers[instruction](chip8, instruction);
+        chip8->I &= 0x0FFF;
+        if (chip8->I > RAM_SIZE - 16)
+            chip8->I = 0x300;
+    }
+    sink = chip8->pc;
+}
+
+static void setup_operands(BenchContext* ctx) {
+    reset_machine(ctx);
+    for (unsigned int i = 0; i < STREAM_SIZE; i++) {
+        ctx->operands[i][0] = bench_random() & 0xF;
+        ctx->operands[i][1] = bench_random() & 0xF;
+        ctx->operands[i][2] = bench_random();
+    }
+}
+
+static void run_draw_sprite(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned long i = 0; i < ops; i++) {
+        const uint8_t* op = ctx->operands[i % STREAM_SIZE];
+        chip8->I = 0x200 + op[2] * 8;
+        draw_sprite(chip8, op[0], op[1], 1 + (op[2] & 0xE));
+    }
+    sink = chip8->v[0xF];
+}
+
+static void run_instruction8(BenchContext* ctx, unsigned long ops) {
+    static const uint8_t alu[] = {0x0, 0x1, 0x2, 0x3, 0x4,
+                                  0x5, 0x6, 0x7, 0xE};
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned long i = 0; i < ops; i++) {
+        const uint8_t* op = ctx->operands[i % STREAM_SIZE];
+        instruction8_handler(op[0], op[1], alu[op[2] % sizeof(alu)], chip8);
+    }
+    sink = chip8->v[0xF];
+}
+
+static void run_instructionF(BenchContext* ctx, unsigned long ops) {
+    static const uint8_t misc[] = {0x07, 0x15, 0x18, 0x33, 0x1E, 0x55, 0x65};
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned long i = 0; i < ops; i++) {
+        const uint8_t* op = ctx->operands[i % STREAM_SIZE];
+        chip8->I = 0x300;
+        instructionF_handler(op[0], misc[op[2] % sizeof(misc)], chip8);
+    }
+    sink = chip8->I;
+}
+
+static void setup_frames(BenchContext* ctx) {
+    // Sparse changes, like a game moving a few sprites per frame
+    reset_machine(ctx);
+    for (unsigned int i = 0; i < STREAM_SIZE; i++) {
+        ctx->rows[i] = (uint64_t)0xFF << (bench_random() % 57);
+    }
+    renderer_init(ctx->renderer, ctx->renderer->fd, FALSE);
+}
+
+static void run_render_frame(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    size_t bytes = 0;
+    for (unsigned long i = 0; i < ops; i++) {
+        chip8->display_buffer[i % DISPLAY_Y] ^= ctx->rows[i % STREAM_SIZE];
+        bytes += render_frame(ctx->renderer, chip8);
+    }
+    sink = bytes;
+}
+
+static void run_display(BenchContext* ctx, unsigned long ops) {
+    Chip8* chip8 = ctx->chip8;
+    for (unsigned long i = 0; i < ops; i++) {
+        chip8->display_buffer[i % DISPLAY_Y] ^= ctx->rows[i % STREAM_SIZE];
+        display(chip8);
+    }
+    fflush(stdout);
+}
+
+static void setup_rom(BenchContext* ctx) {
+    if (ctx->rom)
+        return;
+    unsigned char rom[ROM_MAX_SIZE];
+    for (unsigned int i = 0; i < ROM_MAX_SIZE; i++) {
+        rom[i] = bench_random();
+    }
+    strcpy(ctx->rom_path, "/tmp/chip8_benchXXXXXX");
+    int fd = mkstemp(ctx->rom_path);
+    if (fd < 0 || write(fd, rom, sizeof(rom)) != sizeof(rom) ||
+        rom_cache_get(&ctx->rom_cache, ctx->rom_path, &ctx->rom) != CHIP8_OK) {
+        printf("%s\n", "Failed to write bench rom. Exiting.");
+        exit(-1);
+    }
+    close(fd);
+}
+
+static void run_load_rom(BenchContext* ctx, unsigned long ops) {
+    for (unsigned long i = 0; i < ops; i++) {
+        Chip8* chip8 = init_machine();
+        load_rom(chip8, ctx->rom_path, 0x200);
+        sink = chip8->mem[0x200];
+        free_machine(chip8);
+    }
+}
+
+static void run_load_cached_rom(BenchContext* ctx, unsigned long ops) {
+    for (unsigned long i = 0; i < ops; i++) {
+        Chip8* chip8 = init_machine();
+        load_cached_rom(chip8, ctx->rom);
+        sink = chip8->mem[0x200];
+        free_machine(chip8);
+    }
+}
+
+static const Benchmark benchmarks[] = {
+    {"fetch", setup_fetch, run_fetch, 1},
+    {"decode", setup_decode, run_decode, 1},
+    // Same stream through the 64K handler table. The stream touches about
+    // as many table lines as it has distinct opcodes, so this includes the
+    // table's cache misses.
+    {"decode_table", setup_decode, run_decode_table, 1},
+    {"draw_sprite", setup_operands, run_draw_sprite, 1},
+    {"instruction8_handler", setup_operands, run_instruction8, 1},
+    {"instructionF_handler", setup_operands, run_instructionF, 1},
+    {"render_frame", setup_frames, run_render_frame, 10},
+    // Forks a shell for clear on every call
+    {"display", setup_frames, run_display, 1000},
+    // Machine startup: read the ROM file each time, or copy the mapping
+    {"load_rom", setup_rom, run_load_rom, 100},
+    {"load_cached_rom", setup_rom, run_load_cached_rom, 100},
+};
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static BenchResult run_benchmark(const Benchmark* bench,
+                                 BenchContext* ctx,
+                                 unsigned long ops,
+                                 unsigned int warmup,
+                                 unsigned int repetitions) {
+    BenchResult result;
+    double* samples = malloc(repetitions * sizeof(double));
+    if (!samples) {
+        printf("%s\n", "Failed to allocate memory for samples. Exiting.");
+        exit(-1);
+    }
+
+    ops /= bench->ops_divisor;
+    if (ops == 0)
+        ops = 1;
+    bench->setup(ctx);
+    for (unsigned int i = 0; i < warmup; i++) {
+        bench->run(ctx, ops);
+    }
+    for (unsigned int i = 0; i < repetitions; i++) {
+        double start = now_ns();
+        bench->run(ctx, ops);
+        samples[i] = (now_ns() - start) / ops;
+    }
+
+    qsort(samples, repetitions, sizeof(double), compare_doubles);
+    result.ops = ops;
+    result.repetitions = repetitions;
+    result.median_ns = samples[repetitions / 2];
+    result.p99_ns = samples[(repetitions * 99 + 99) / 100 - 1];
+    result.min_ns = samples[0];
+    free(samples);
+    return result;
+}
+
+static void print_result(FILE* out,
+                         OutputFormat format,
+                         const char* name,
+                         const BenchResult* result,
+                         int first) {
+    if (format == FORMAT_CSV) {
+        fprintf(out, "%s,%lu,%u,%.3f,%.3f,%.3f\n", name, result->ops,
+                result->repetitions, result->median_ns, result->p99_ns,
+                result->min_ns);
+    } else {
+        fprintf(out,
+                "%s    {\"name\": \"%s\", \"ops\": %lu, \"repetitions\": %u, "
+                "\"median_ns\": %.3f, \"p99_ns\": %.3f, \"min_ns\": %.3f}",
+                first ? "" : ",\n", name, result->ops, result->repetitions,
+                result->median_ns, result->p99_ns, result->min_ns);
+    }
+}
+
+static void usage(const char* program) {
+    printf("Usage: %s [-f csv|json] [-n ops] [-r reps] [-w warmup] [name...]\n",
+           program);
+    printf("%s\n", "  -f format  output format: csv (default) or json");
+    printf("  -n ops     operations per repetition (default %d)\n",
+           DEFAULT_OPS);
+    printf("  -r reps    timed repetitions (default %d)\n",
+           DEFAULT_REPETITIONS);
+    printf("  -w warmup  untimed repetitions first (default %d)\n",
+           DEFAULT_WARMUP);
+    printf("%s", "  name       benchmarks to run (default: all of");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        printf(" %s", benchmarks[i].name);
+    }
+    printf("%s\n", ")");
+}
+
+static int selected(const char* name, char** names, int num_names) {
+    if (num_names == 0)
+        return TRUE;
+    for (int i = 0; i < num_names; i++) {
+        if (strcmp(names[i], name) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+int main(int argc, char** argv) {
+    OutputFormat format = FORMAT_CSV;
+    unsigned long ops = DEFAULT_OPS;
+    unsigned int repetitions = DEFAULT_REPETITIONS;
+    unsigned int warmup = DEFAULT_WARMUP;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:r:w:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    format = FORMAT_JSON;
+                } else if (strcmp(optarg, "csv") != 0) {
+                    printf("Unknown format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                ops = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                repetitions = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                warmup = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (ops == 0 || repetitions == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Results go to the original stdout; everything the renderers and clear
+    // print is sent to /dev/null instead
+    int null_fd = open("/dev/null", O_WRONLY);
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (null_fd < 0 || !out) {
+        printf("%s\n", "Failed to open /dev/null. Exiting.");
+        exit(-1);
+    }
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    BenchContext* ctx = calloc(1, sizeof(BenchContext));
+    Renderer* renderer = malloc(sizeof(Renderer));
+    if (ctx)
+        ctx->chip8 = init_machine();
+    if (!ctx || !ctx->chip8 || !renderer) {
+        fprintf(out, "%s\n", "Failed to allocate memory for bench. Exiting.");
+        exit(-1);
+    }
+    ctx->renderer = renderer;
+    renderer->fd = null_fd;
+    rom_cache_init(&ctx->rom_cache);
+
+    if (format == FORMAT_CSV) {
+        fprintf(out, "%s\n",
+                "benchmark,ops,repetitions,median_ns,p99_ns,min_ns");
+    } else {
+        fprintf(out, "%s\n", "{\"benchmarks\": [");
+    }
+    int first = TRUE;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (!selected(benchmarks[i].name, argv + optind, argc - optind))
+            continue;
+        BenchResult result =
+            run_benchmark(&benchmarks[i], ctx, ops, warmup, repetitions);
+        print_result(out, format, benchmarks[i].name, &result, first);
+        fflush(out);
+        first = FALSE;
+    }
+    if (format == FORMAT_JSON)
+        fprintf(out, "%s\n", "\n]}");
+
+    if (ctx->rom)
+        unlink(ctx->rom_path);
+    rom_cache_free(&ctx->rom_cache);
+    free_machine(ctx->chip8);
+    free(renderer);
+    free(ctx);
+    fclose(out);
+    close(null_fd);
+    return 0;
+}
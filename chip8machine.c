@@ -0,0 +1,681 @@
+#include "chip8machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "inputlog.h"
+#include "jit.h"
+#include "optable.h"
+#include "threaded.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// Instructions run_tick() runs between checks for a wait loop
+#define IDLE_CHECK_CYCLES 1024
+// Longest wait loop idle_loop_length() recognises
+#define IDLE_MAX_LOOP 3
+
+unsigned char read_memory(Chip8* chip8, unsigned int addr) {
+    // Reads past the end of RAM fault the machine and read as 0
+    if (addr >= RAM_SIZE) {
+        chip8->fault = FAULT_BAD_ADDRESS;
+        return 0;
+    }
+    return chip8->mem[addr];
+}
+
+int write_memory(Chip8* chip8,
+                 unsigned int addr,
+                 const unsigned char* bytes,
+                 unsigned int num_bytes) {
+    if (addr > RAM_SIZE || num_bytes > RAM_SIZE - addr)
+        return FALSE;
+
+    memcpy(chip8->mem + addr, bytes, num_bytes);
+    invalidate_code(chip8, addr, num_bytes);
+    return TRUE;
+}
+
+void invalidate_code(Chip8* chip8, unsigned int addr, unsigned int num_bytes) {
+    // Guest memory changed, drop anything decoded or translated from it
+    icache_invalidate(chip8, addr, num_bytes);
+    jit_invalidate(chip8, addr, num_bytes);
+    aot_invalidate(chip8, addr, num_bytes);
+}
+
+int load_rom_buffer(Chip8* chip8,
+                    const unsigned char* rom,
+                    size_t size,
+                    unsigned int addr) {
+    if (addr > RAM_SIZE || size > RAM_SIZE - addr)
+        return FALSE;
+    write_memory(chip8, addr, rom, size);
+    chip8->pc = addr;
+    return TRUE;
+}
+
+int load_rom(Chip8* chip8,
+             const char* rom_file_name,
+             const unsigned int addr) {
+    FILE* f = NULL;
+    if (rom_file_name) {
+        f = fopen(rom_file_name, "rb");
+    } else {
+        f = fopen("ibm_logo.ch8", "rb");
+    }
+
+    if (!f)
+        return FALSE;
+
+    // One byte more than fits, so an oversized file is caught
+    unsigned char rom[RAM_SIZE + 1];
+    size_t size = addr <= RAM_SIZE ? fread(rom, 1, RAM_SIZE - addr + 1, f) : 0;
+    int ok = !ferror(f) && load_rom_buffer(chip8, rom, size, addr);
+
+    fclose(f);
+    return ok;
+}
+
+void set_register(Chip8* chip8, uint8_t x, uint16_t nn) {
+    chip8->v[x] = nn;
+}
+
+unsigned char read_register(Chip8* chip8, uint8_t x) {
+    return chip8->v[x];
+}
+
+void add_to_register(Chip8* chip8, uint8_t x, uint16_t nn) {
+    unsigned char value = read_register(chip8, x);
+    set_register(chip8, x, value + nn);
+}
+
+void random_register(Chip8* chip8, uint8_t x, uint8_t nn) {
+    uint8_t rnd;
+    if (chip8->input_log) {
+        rnd = input_log_random(chip8->input_log, chip8);
+    } else {
+        rnd = next_random(chip8);
+    }
+    set_register(chip8, x, rnd & nn);
+}
+
+void seed_random(Chip8* chip8, uint64_t seed) {
+    // splitmix64 finalizer, so nearby seeds start far apart
+    uint64_t z = seed + DEFAULT_SEED;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    chip8->rng = z ? z : DEFAULT_SEED;
+}
+
+uint8_t next_random(Chip8* chip8) {
+    // xorshift64*, the top byte of the product is the best mixed
+    uint64_t s = chip8->rng;
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    chip8->rng = s;
+    return (s * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+uint8_t read_delay_timer(Chip8* chip8) {
+    uint64_t expiry = chip8->delay_expiry;
+    return expiry > chip8->ticks ? expiry - chip8->ticks : 0;
+}
+
+void set_delay_timer(Chip8* chip8, uint8_t value) {
+    chip8->delay_expiry = chip8->ticks + value;
+}
+
+uint8_t read_sound_timer(Chip8* chip8) {
+    uint64_t expiry = chip8->sound_expiry;
+    return expiry > chip8->ticks ? expiry - chip8->ticks : 0;
+}
+
+void set_sound_timer(Chip8* chip8, uint8_t value) {
+    chip8->sound_expiry = chip8->ticks + value;
+}
+
+int sound_active(Chip8* chip8) {
+    return chip8->sound_expiry > chip8->ticks;
+}
+
+int valid_pc(unsigned long pc) {
+    return pc < ICACHE_SIZE;
+}
+
+uint16_t fetch(Chip8* chip8) {
+    if (chip8->pc >= RAM_SIZE - 1) {
+        // Ran off the end of RAM: park here, executing nothing
+        chip8->fault = FAULT_BAD_ADDRESS;
+        return 0x0000;
+    }
+    unsigned char first_byte = chip8->mem[chip8->pc];
+    chip8->pc++;
+    unsigned char second_byte = chip8->mem[chip8->pc];
+    chip8->pc++;
+    uint16_t instruction = ((uint16_t)first_byte << 8 | second_byte);
+    return instruction;
+}
+
+void clear_screen(Chip8* chip8) {
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        chip8->display_buffer[row] = 0;
+    }
+}
+
+unsigned char get_pixel(Chip8* chip8, unsigned int x, unsigned int y) {
+    // Column 0 is the most significant bit of a row
+    return (chip8->display_buffer[y] >> (DISPLAY_X - 1 - x)) & 1;
+}
+
+void draw_sprite(Chip8* chip8, uint8_t x, uint8_t y, uint8_t n) {
+    uint8_t loc_x = chip8->v[x];
+    uint8_t loc_y = chip8->v[y];
+    uint64_t collision = 0;
+
+    loc_x = loc_x % DISPLAY_X;
+    loc_y = loc_y % DISPLAY_Y;
+
+    // Rows past the bottom edge are clipped and never read
+    unsigned int rows = n < DISPLAY_Y - loc_y ? n : DISPLAY_Y - loc_y;
+    if (chip8->I + rows > RAM_SIZE) {
+        raise_fault(chip8, FAULT_BAD_ADDRESS);
+        return;
+    }
+
+    set_register(chip8, 0xF, 0);
+
+    for (unsigned int row = 0; row < rows; row++) {
+        uint64_t sprite_byte = chip8->mem[chip8->I + row];
+        // Line the sprite byte up with its columns; pixels past the right
+        // edge are clipped
+        uint64_t sprite_row = loc_x <= DISPLAY_X - 8
+                                  ? sprite_byte << (DISPLAY_X - 8 - loc_x)
+                                  : sprite_byte >> (loc_x - (DISPLAY_X - 8));
+        uint64_t* display_row = &chip8->display_buffer[loc_y + row];
+
+        collision |= *display_row & sprite_row;
+        *display_row ^= sprite_row;
+    }
+
+    if (collision)
+        set_register(chip8, 0xF, 1);
+}
+
+void instruction8_handler(uint8_t x, uint8_t y, uint8_t n, Chip8* chip8) {
+    unsigned char vx = read_register(chip8, x);
+    unsigned char vy = read_register(chip8, y);
+    uint16_t result;
+
+    switch (n) {
+        case 0x0:
+            // Set
+            set_register(chip8, x, vy);
+            break;
+        case 0x1:
+            // Binary OR
+            set_register(chip8, x, vx | vy);
+            break;
+        case 0x2:
+            // Binary AND
+            set_register(chip8, x, vx & vy);
+            break;
+        case 0x3:
+            // Logical XOR
+            set_register(chip8, x, vx ^ vy);
+            break;
+        case 0x4:
+            // Add
+            result = vx + vy;
+            if (result > 255) {
+                set_register(chip8, 0xF, 1);
+            } else {
+                set_register(chip8, 0xF, 0);
+            }
+            set_register(chip8, 0xF, result > 255 ? 1 : 0);
+            set_register(chip8, x, result);
+            break;
+        case 0x5:
+            // Subtract VX-VY
+            result = vx - vy;
+            set_register(chip8, 0xF, result >= 0 ? 1 : 0);
+            set_register(chip8, x, result);
+            break;
+        case 0x7:
+            // Subtract VY-VX
+            result = vy - vx;
+            set_register(chip8, 0xF, result >= 0 ? 1 : 0);
+            set_register(chip8, x, result);
+            break;
+        case 0x6:
+            // VX = (VY >> 1) Right Shift
+            {
+                const unsigned char shifted_bit = (0x01 & vy);
+                set_register(chip8, 0xF, shifted_bit);
+                set_register(chip8, x, (vy >> 1));
+            }
+            break;
+        case 0xE:
+            // VX = (VY << 1) Left Shift
+            {
+                const unsigned char shifted_bit = (0x80 & vy) >> 7;
+                set_register(chip8, 0xF, shifted_bit);
+                set_register(chip8, x, (vy << 1));
+            }
+            break;
+        default:
+            printf("Unhandled instruction: 0x8%x%x%x.\n", x, y, n);
+            break;
+    }
+}
+
+void store_memory(Chip8* chip8, const unsigned char x) {
+    // Write value of each register from v0 to vx(inclusive) to successive
+    // addresses, starting at I
+    if (chip8->I + x >= RAM_SIZE) {
+        raise_fault(chip8, FAULT_BAD_ADDRESS);
+        return;
+    }
+
+    for (uint8_t n = 0; n <= x; n++) {
+        unsigned char value = read_register(chip8, n);
+        chip8->mem[chip8->I + n] = value;
+    }
+    invalidate_code(chip8, chip8->I, x + 1);
+}
+
+void load_memory(Chip8* chip8, const unsigned int x) {
+    // Load memory values from I to I+x and load them into registers from
+    // v0 to vx
+    if (chip8->I + x >= RAM_SIZE) {
+        raise_fault(chip8, FAULT_BAD_ADDRESS);
+        return;
+    }
+
+    for (uint8_t n = 0; n <= x; n++) {
+        unsigned char value = chip8->mem[chip8->I + n];
+        set_register(chip8, n, value);
+    }
+}
+
+void instructionE_handler(uint8_t x, uint16_t nn, Chip8* chip8) {
+    const unsigned int pressed =
+        (chip8->keypad >> (read_register(chip8, x) & 0xF)) & 1;
+    switch (nn) {
+        case 0x9E:
+            // Skip if the key in VX is held
+            if (pressed)
+                chip8->pc += 2;
+            break;
+        case 0xA1:
+            // Skip if the key in VX is not held
+            if (!pressed)
+                chip8->pc += 2;
+            break;
+        default:
+            printf("Unhandled instruction: 0xE%x%02x.\n", x, nn);
+            break;
+    }
+}
+
+void instructionF_handler(uint8_t x, uint16_t nn, Chip8* chip8) {
+    switch (nn) {
+        case 0x7:
+            // Set VX to current delay timer
+            set_register(chip8, x, read_delay_timer(chip8));
+            break;
+        case 0xA:
+            // Wait for a key: repeat this instruction until one is held
+            if (chip8->keypad == 0) {
+                chip8->pc -= 2;
+            } else {
+                uint8_t key = 0;
+                while (!((chip8->keypad >> key) & 1))
+                    key++;
+                set_register(chip8, x, key);
+            }
+            break;
+        case 0x15:
+            // Set delay timer to VX
+            set_delay_timer(chip8, read_register(chip8, x));
+            break;
+        case 0x18:
+            // Set sound timer to VX
+            set_sound_timer(chip8, read_register(chip8, x));
+            break;
+        case 0x33:
+            // Binary Coded Decimal Conversion
+            if (chip8->I + 2 >= RAM_SIZE) {
+                raise_fault(chip8, FAULT_BAD_ADDRESS);
+            } else {
+                unsigned char value = read_register(chip8, x);
+                unsigned char d1 = (value / 100);
+                unsigned char d2 = ((value / 10) % 10);
+                unsigned char d3 = (value % 10);
+
+                chip8->mem[chip8->I] = d1;
+                chip8->mem[chip8->I + 1] = d2;
+                chip8->mem[chip8->I + 2] = d3;
+                invalidate_code(chip8, chip8->I, 3);
+            }
+            break;
+        case 0x1E:
+            // Instruction register += VX;
+            chip8->I += read_register(chip8, x);
+            break;
+        case 0x55:
+            store_memory(chip8, x);
+            break;
+        case 0x65:
+            load_memory(chip8, x);
+            break;
+        default:
+            break;
+    }
+}
+
+void decode(uint16_t instruction, Chip8* chip8) {
+    uint8_t w = (instruction & 0xF000) >> 12;
+    uint8_t x = (instruction & 0x0F00) >> 8;
+    uint8_t y = (instruction & 0x00F0) >> 4;
+    uint8_t n = instruction & 0x000F;
+    unsigned char nn = instruction & 0x00FF;
+    uint16_t nnn = instruction & 0x0FFF;
+
+    if (instruction == 0x00E0) {
+        // Clear Screen
+        clear_screen(chip8);
+    } else if (instruction == 0x00EE) {
+        // Return from Subroutine
+        uint16_t addr;
+        if (stack_pop(&(chip8->stack), &addr)) {
+            chip8->pc = addr;
+        } else {
+            raise_fault(chip8, FAULT_STACK_UNDERFLOW);
+        }
+    }
+
+    switch (w) {
+        case 0x0:
+            // 0NNN: Skip
+            break;
+        case 0x1:
+            // 1NNN: Unconditional Jump to NNN
+            chip8->pc = nnn;
+            break;
+        case 0x2:
+            // 2NNN: Call Subroutine at NNN
+            if (stack_push(&(chip8->stack), chip8->pc)) {
+                chip8->pc = nnn;
+            } else {
+                raise_fault(chip8, FAULT_STACK_OVERFLOW);
+            }
+            break;
+        case 0x3:
+            // 3XNN: Conditional Skip if VX==NN
+            if (read_register(chip8, x) == nn) {
+                chip8->pc++;
+                chip8->pc++;
+            }
+            break;
+        case 0x4:
+            // 4XNN: Conditional Skip if VX!=NN
+            if (read_register(chip8, x) != nn) {
+                chip8->pc++;
+                chip8->pc++;
+            }
+            break;
+        case 0x5:
+            // 5XY0: Conditional Skip if VX==VY
+            if (read_register(chip8, x) == read_register(chip8, y)) {
+                chip8->pc++;
+                chip8->pc++;
+            }
+            break;
+        case 0x6:
+            // set vx
+            set_register(chip8, x, nn);
+            break;
+        case 0x7:
+            // add nn to x
+            add_to_register(chip8, x, nn);
+            break;
+        case 0x8:
+            // logic and arithmetic
+            instruction8_handler(x, y, n, chip8);
+            break;
+        case 0x9:
+            // 9XY0: Conditional Skip if VX!=VY
+            if (read_register(chip8, x) != read_register(chip8, y)) {
+                chip8->pc++;
+                chip8->pc++;
+            }
+            break;
+        case 0xA:
+            // set index register
+            chip8->I = nnn;
+            break;
+        case 0xB:
+            // Jump with offset
+            {
+                const unsigned char v0 = read_register(chip8, 0x0);
+                chip8->I = nnn + v0;
+            }
+            break;
+        case 0xC:
+            // Generate Random Number
+            random_register(chip8, x, nn);
+            break;
+        case 0xD:
+            // draw DXYN
+            draw_sprite(chip8, x, y, n);
+            break;
+        case 0xE:
+            // Keypad skips
+            instructionE_handler(x, nn, chip8);
+            break;
+        case 0xF:
+            // Timer, Misc
+            instructionF_handler(x, nn, chip8);
+            break;
+        default:
+            printf("Unhandled instruction: %x.\n", instruction);
+            break;
+    }
+}
+
+void store_font(Chip8* chip8, unsigned int addr) {
+    unsigned char fontset[] = {
+        0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
+        0x20, 0x60, 0x20, 0x20, 0x70,  // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80   // F
+    };
+    unsigned char* font = fontset;
+    write_memory(chip8, addr, font, 80);
+}
+
+Chip8* init_machine() {
+    Chip8* chip8 = calloc(1, sizeof(Chip8));
+    if (!chip8)
+        return NULL;
+    stack_init(&(chip8->stack));
+    seed_random(chip8, 0);
+    icache_init(chip8);
+    store_font(chip8, 0x50);
+
+    return chip8;
+}
+
+void tick_timers(Chip8* chip8) {
+    // Called at 60 Hz
+    chip8->ticks++;
+}
+
+void free_machine(Chip8* chip8) {
+    jit_free(chip8);
+    aot_free(chip8);
+    free(chip8);
+}
+
+unsigned char detect_stuck(Chip8* chip8) {
+    // A jump to its own address is how CHIP-8 programs park themselves
+    unsigned int pc = chip8->pc;
+    if (pc >= RAM_SIZE - 1)
+        return FALSE;
+    uint16_t instruction = (uint16_t)chip8->mem[pc] << 8 | chip8->mem[pc + 1];
+    return instruction == (0x1000 | pc);
+}
+
+static uint16_t instruction_at(Chip8* chip8, unsigned int addr) {
+    return (uint16_t)chip8->mem[addr] << 8 | chip8->mem[addr + 1];
+}
+
+unsigned int idle_loop_length(Chip8* chip8) {
+    // Recognises a wait loop starting at pc that only a timer tick or a key
+    // change can end, and whose every further iteration leaves the machine
+    // exactly as it is. Returns the loop's length in instructions, or 0.
+    unsigned int pc = chip8->pc;
+    if (pc >= RAM_SIZE - 5)
+        return 0;
+    uint16_t first = instruction_at(chip8, pc);
+    uint16_t second = instruction_at(chip8, pc + 2);
+    uint8_t x = (first & 0x0F00) >> 8;
+    unsigned int held = (chip8->keypad >> (chip8->v[x] & 0xF)) & 1;
+
+    if (first == (0x1000 | pc))
+        return 1;
+    if ((first & 0xF0FF) == 0xF00A && chip8->keypad == 0)
+        return 1;
+    if (second == (0x1000 | pc)) {
+        // EX9E / EXA1 jumping back until the key goes down / up
+        if ((first & 0xF0FF) == 0xE09E && !held)
+            return 2;
+        if ((first & 0xF0FF) == 0xE0A1 && held)
+            return 2;
+    }
+    // FX07, 3XKK, jump back: polls the delay timer until it reaches KK.
+    // Only a no-op once VX already holds the timer.
+    uint8_t delay = read_delay_timer(chip8);
+    if ((first & 0xF0FF) == 0xF007 && (second & 0xFF00) == (0x3000 | x << 8) &&
+        instruction_at(chip8, pc + 4) == (0x1000 | pc) &&
+        chip8->v[x] == delay && delay != (second & 0xFF))
+        return 3;
+    return 0;
+}
+
+void raise_fault(Chip8* chip8, Chip8Fault fault) {
+    // Back up to the faulting instruction, which is where the machine stays
+    chip8->fault = fault;
+    chip8->pc -= 2;
+}
+
+const char* fault_name(Chip8Fault fault) {
+    switch (fault) {
+        case FAULT_STACK_OVERFLOW:
+            return "stack overflow";
+        case FAULT_STACK_UNDERFLOW:
+            return "stack underflow";
+        case FAULT_BAD_ADDRESS:
+            return "bad address";
+        default:
+            return "none";
+    }
+}
+
+void run_cycles(Chip8* chip8, Chip8Core core, unsigned long cycles) {
+    PROFILE_ATTACH(chip8);
+    switch (core) {
+        case CORE_SWITCH:
+            for (unsigned long i = 0; i < cycles; i++) {
+                PROFILE_INSTRUCTION(chip8, chip8->pc);
+                uint16_t instr = fetch(chip8);
+                decode(instr, chip8);
+            }
+            break;
+        case CORE_CACHED:
+            run_cached(chip8, cycles);
+            break;
+        case CORE_THREADED:
+            run_threaded(chip8, cycles);
+            break;
+        case CORE_JIT:
+            run_jit(chip8, cycles);
+            break;
+        case CORE_AOT:
+            run_aot(chip8, cycles);
+            break;
+        case CORE_TABLE:
+            run_table(chip8, cycles);
+            break;
+    }
+    PROFILE_DETACH();
+}
+
+void run_tick(Chip8* chip8, Chip8Core core, unsigned long cycles) {
+    // Timers and keys only change between calls, so once the program is in
+    // a wait loop, whole iterations up to the end of the call change nothing
+    // and are skipped. Only the leftover partial iteration is run.
+    while (cycles > 0) {
+        // Step to the head of the loop if the last slice ended inside one
+        unsigned int length = idle_loop_length(chip8);
+        for (unsigned int step = 1;
+             !length && step < IDLE_MAX_LOOP && cycles > 0; step++) {
+            run_cycles(chip8, core, 1);
+            cycles--;
+            length = idle_loop_length(chip8);
+        }
+        if (length)
+            cycles %= length;
+
+        unsigned long slice =
+            cycles < IDLE_CHECK_CYCLES ? cycles : IDLE_CHECK_CYCLES;
+        run_cycles(chip8, core, slice);
+        cycles -= slice;
+    }
+}
+
+uint64_t hash_bytes(uint64_t hash, const unsigned char* bytes, size_t len) {
+    // FNV-1a, 64 bit
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_display(Chip8* chip8) {
+    // Hashed as one byte per pixel so the value does not depend on packing
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        for (unsigned int col = 0; col < DISPLAY_X; col++) {
+            unsigned char pixel = get_pixel(chip8, col, row);
+            hash = hash_bytes(hash, &pixel, 1);
+        }
+    }
+    return hash;
+}
+
+uint64_t hash_machine(Chip8* chip8) {
+    // Fingerprint of the observable machine state, continuing the display's
+    uint64_t hash = hash_display(chip8);
+    hash = hash_bytes(hash, chip8->mem, RAM_SIZE);
+    hash = hash_bytes(hash, chip8->v, sizeof(chip8->v));
+    return hash;
+}
+
@@ -1,16 +1,34 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "libchip8.h"
 #include "stack.h"
 #define RAM_SIZE 4096
 #define DISPLAY_X 64
 #define DISPLAY_Y 32
 #define DISPLAY_SIZE DISPLAY_X* DISPLAY_Y
+#define NUM_KEYS 16
+// Seed of a fresh machine, so runs repeat exactly unless reseeded
+#define DEFAULT_SEED 0x9E3779B97F4A7C15ULL
 
-typedef struct {
-    // Display Buffer
-    unsigned char display_buffer[DISPLAY_SIZE];
+#include "icache.h"
+#include "profile.h"
+
+// Errors in the guest program. The faulting instruction stays at pc and
+// faults again if executed, so the machine is parked until it is reset.
+typedef enum {
+    FAULT_NONE,
+    FAULT_STACK_OVERFLOW,
+    FAULT_STACK_UNDERFLOW,
+    // Fetch, sprite or register load/store past the end of RAM
+    FAULT_BAD_ADDRESS,
+} Chip8Fault;
+
+typedef struct Chip8 {
+    // Display Buffer, one bit per pixel
+    uint64_t display_buffer[DISPLAY_Y];
     // RAM
     unsigned char mem[RAM_SIZE];
     // Program Counter
@@ -18,9 +36,93 @@ typedef struct {
     // Instruction
     uint16_t I;
     Stack stack;
-    uint8_t delay_timer;
-    uint8_t sound_timer;
+    // 60 Hz timer ticks since the machine was created
+    uint64_t ticks;
+    // The timers are never counted down. Each holds the tick it reaches
+    // zero on and its value is worked out when read, so ticking is a single
+    // increment however many ticks pass.
+    uint64_t delay_expiry;
+    uint64_t sound_expiry;
     unsigned char v[16];
+    // One bit per hex key, set by the host while the key is held down
+    uint16_t keypad;
+    // xorshift64* state behind CXNN, never zero
+    uint64_t rng;
+    Chip8Fault fault;
+    // Pre-decoded instructions, one slot per address in mem
+    DecodedInstr icache[ICACHE_SIZE];
+    // Dispatches each kind of superinstruction has saved the cached and
+    // threaded cores
+    uint64_t fusion_saved[NUM_FUSED_OPS];
+    // Translated code, created on first use by the JIT core
+    struct JitState* jit;
+    // Ahead-of-time translation of the loaded ROM, if one was attached
+    struct AotState* aot;
+    // Log that records or replays keypad and CXNN inputs, if attached
+    struct InputLog* input_log;
+#ifdef CHIP8_PROFILE
+    Profile profile;
+#endif
 } Chip8;
 
+unsigned char read_memory(Chip8* chip8, unsigned int addr);
+// Return FALSE, changing nothing, if the bytes do not fit in RAM or the
+// file cannot be read
+int write_memory(Chip8* chip8,
+                 unsigned int addr,
+                 const unsigned char* bytes,
+                 unsigned int num_bytes);
+int load_rom_buffer(Chip8* chip8,
+                    const unsigned char* rom,
+                    size_t size,
+                    unsigned int addr);
+int load_rom(Chip8* chip8, const char* rom_file_name, const unsigned int addr);
+void invalidate_code(Chip8* chip8, unsigned int addr, unsigned int num_bytes);
+
+void set_register(Chip8* chip8, uint8_t x, uint16_t nn);
+unsigned char read_register(Chip8* chip8, uint8_t x);
+void add_to_register(Chip8* chip8, uint8_t x, uint16_t nn);
+void random_register(Chip8* chip8, uint8_t x, uint8_t nn);
+void seed_random(Chip8* chip8, uint64_t seed);
+uint8_t next_random(Chip8* chip8);
+uint8_t read_delay_timer(Chip8* chip8);
+void set_delay_timer(Chip8* chip8, uint8_t value);
+uint8_t read_sound_timer(Chip8* chip8);
+void set_sound_timer(Chip8* chip8, uint8_t value);
+int sound_active(Chip8* chip8);
+
+// Whether a run can carry on from pc: anywhere a run itself can leave it,
+// up to the slots past the end of RAM where the next fetch faults
+int valid_pc(unsigned long pc);
+uint16_t fetch(Chip8* chip8);
+void decode(uint16_t instruction, Chip8* chip8);
+void instruction8_handler(uint8_t x, uint8_t y, uint8_t n, Chip8* chip8);
+void instructionE_handler(uint8_t x, uint16_t nn, Chip8* chip8);
+void instructionF_handler(uint8_t x, uint16_t nn, Chip8* chip8);
+
+void clear_screen(Chip8* chip8);
+unsigned char get_pixel(Chip8* chip8, unsigned int x, unsigned int y);
+void draw_sprite(Chip8* chip8, uint8_t x, uint8_t y, uint8_t n);
+void store_memory(Chip8* chip8, const unsigned char x);
+void load_memory(Chip8* chip8, const unsigned int x);
+
+void store_font(Chip8* chip8, unsigned int addr);
+// Returns NULL if the machine cannot be allocated
+Chip8* init_machine();
+void free_machine(Chip8* chip8);
+unsigned char detect_stuck(Chip8* chip8);
+unsigned int idle_loop_length(Chip8* chip8);
+void raise_fault(Chip8* chip8, Chip8Fault fault);
+const char* fault_name(Chip8Fault fault);
+// Advances the timers by one 60 Hz tick
+void tick_timers(Chip8* chip8);
+void run_cycles(Chip8* chip8, Chip8Core core, unsigned long cycles);
+// Same end state as run_cycles(), provided the timers and keypad do not
+// change during the call, but wait loops are skipped instead of spun
+void run_tick(Chip8* chip8, Chip8Core core, unsigned long cycles);
+
+uint64_t hash_bytes(uint64_t hash, const unsigned char* bytes, size_t len);
+uint64_t hash_display(Chip8* chip8);
+uint64_t hash_machine(Chip8* chip8);
+
 #endif
@@ -0,0 +1,673 @@
+#include "gdbstub.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "scheduler.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// Longest packet either side sends, in characters between $ and #
+#define GDB_PACKET_SIZE 4096
+#define GDB_TARGET_XML_SIZE (256 + 64 * GDB_NUM_REGS)
+// Instructions a continue runs between checks for an interrupt
+#define GDB_POLL_CYCLES 65536
+
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+#define GDB_SIGSEGV 11
+
+typedef struct {
+    Chip8* chip8;
+    Chip8Core core;
+    int fd;
+    // Instructions per timer tick, and how many are left until the next
+    unsigned long tick_cycles;
+    unsigned long until_tick;
+    // Signal reported for the last stop
+    int signal;
+    // Set once the connection is gone
+    int closed;
+    // One bit per address with a breakpoint on it
+    uint64_t breakpoints[RAM_SIZE / 64];
+    // Received bytes not consumed yet
+    unsigned char input[GDB_PACKET_SIZE];
+    size_t input_start;
+    size_t input_end;
+    char packet[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+    char target_xml[GDB_TARGET_XML_SIZE];
+} GdbStub;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int fill_input(GdbStub* stub) {
+    // Waits for input unless some is buffered. Returns FALSE once the
+    // connection is gone.
+    if (stub->input_start < stub->input_end)
+        return TRUE;
+    ssize_t got;
+    do {
+        got = recv(stub->fd, stub->input, sizeof(stub->input), 0);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        stub->closed = TRUE;
+        return FALSE;
+    }
+    stub->input_start = 0;
+    stub->input_end = got;
+    return TRUE;
+}
+
+static int read_byte(GdbStub* stub) {
+    // Returns -1 once the connection is gone
+    if (!fill_input(stub))
+        return -1;
+    return stub->input[stub->input_start++];
+}
+
+static int send_all(GdbStub* stub, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(stub->fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0) {
+            stub->closed = TRUE;
+            return FALSE;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return TRUE;
+}
+
+static int send_packet(GdbStub* stub, const char* data) {
+    char frame[GDB_PACKET_SIZE + 5];
+    size_t length = strlen(data);
+    uint8_t sum = 0;
+
+    frame[0] = '$';
+    for (size_t i = 0; i < length; i++) {
+        frame[1 + i] = data[i];
+        sum += (uint8_t)data[i];
+    }
+    frame[1 + length] = '#';
+    frame[2 + length] = hex_digits[sum >> 4];
+    frame[3 + length] = hex_digits[sum & 0xF];
+    return send_all(stub, frame, length + 4);
+}
+
+static int read_packet(GdbStub* stub) {
+    // Reads the next packet into stub->packet and acknowledges it, asking
+    // for a resend of any that arrive damaged. Returns FALSE once the
+    // connection is gone.
+    for (;;) {
+        int c;
+        do {
+            c = read_byte(stub);
+            if (c < 0)
+                return FALSE;
+        } while (c != '$');
+
+        size_t length = 0;
+        uint8_t sum = 0;
+        int too_long = FALSE;
+        while ((c = read_byte(stub)) != '#') {
+            if (c < 0)
+                return FALSE;
+            if (length < GDB_PACKET_SIZE) {
+                stub->packet[length++] = c;
+            } else {
+                too_long = TRUE;
+            }
+            sum += (uint8_t)c;
+        }
+        stub->packet[length] = '\0';
+        int high = hex_value(read_byte(stub));
+        int low = hex_value(read_byte(stub));
+
+        if (!too_long && high >= 0 && low >= 0 && (high << 4 | low) == sum)
+            return send_all(stub, "+", 1);
+        if (!send_all(stub, "-", 1))
+            return FALSE;
+    }
+}
+
+static int breakpoint_at(const GdbStub* stub, unsigned int addr) {
+    return addr < RAM_SIZE &&
+           (stub->breakpoints[addr / 64] >> (addr % 64)) & 1;
+}
+
+static uint16_t instruction_at(Chip8* chip8, unsigned int addr) {
+    return (uint16_t)chip8->mem[addr] << 8 | chip8->mem[addr + 1];
+}
+
+static int ends_block(uint16_t instruction) {
+    // Anything that can leave pc elsewhere than the next instruction, or
+    // write memory and so change the code still to come
+    switch (instruction >> 12) {
+        case 0x0:
+            return instruction == 0x00EE;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9:
+        case 0xE:
+            return TRUE;
+        case 0xF:
+            return (instruction & 0xFF) == 0x0A ||
+                   (instruction & 0xFF) == 0x33 ||
+                   (instruction & 0xFF) == 0x55;
+        default:
+            return FALSE;
+    }
+}
+
+static unsigned long block_length(GdbStub* stub) {
+    // Instructions from pc to the end of its block, stopping short of the
+    // next breakpoint and of the next timer tick
+    Chip8* chip8 = stub->chip8;
+    unsigned int addr = chip8->pc;
+    unsigned long length = 1;
+    while (length < stub->until_tick && addr < RAM_SIZE - 3 &&
+           !ends_block(instruction_at(chip8, addr)) &&
+           !breakpoint_at(stub, addr + 2)) {
+        addr += 2;
+        length++;
+    }
+    return length;
+}
+
+static void run_block(GdbStub* stub, unsigned long cycles) {
+    run_cycles(stub->chip8, stub->core, cycles);
+    stub->until_tick -= cycles;
+    if (stub->until_tick == 0) {
+        tick_timers(stub->chip8);
+        stub->until_tick = stub->tick_cycles;
+    }
+}
+
+static int interrupted(GdbStub* stub) {
+    // The debugger sends a bare 0x03 to stop a running machine. Acks ahead
+    // of it are dropped, as read_packet would. Anything else starts a
+    // packet, which stops the machine too and stays buffered for
+    // read_packet.
+    struct pollfd pfd = {stub->fd, POLLIN, 0};
+    for (;;) {
+        if (stub->input_start == stub->input_end) {
+            if (poll(&pfd, 1, 0) <= 0)
+                return FALSE;
+            if (!fill_input(stub))
+                return TRUE;
+        }
+        unsigned char c = stub->input[stub->input_start];
+        if (c == 0x03) {
+            stub->input_start++;
+            return TRUE;
+        }
+        if (c != '+' && c != '-')
+            return TRUE;
+        stub->input_start++;
+    }
+}
+
+static void resume(GdbStub* stub) {
+    Chip8* chip8 = stub->chip8;
+    unsigned long until_poll = GDB_POLL_CYCLES;
+
+    for (;;) {
+        unsigned long cycles = block_length(stub);
+        run_block(stub, cycles);
+        if (chip8->fault != FAULT_NONE) {
+            stub->signal = GDB_SIGSEGV;
+            return;
+        }
+        if (breakpoint_at(stub, chip8->pc)) {
+            stub->signal = GDB_SIGTRAP;
+            return;
+        }
+        if (until_poll > cycles) {
+            until_poll -= cycles;
+        } else {
+            until_poll = GDB_POLL_CYCLES;
+            if (interrupted(stub)) {
+                stub->signal = GDB_SIGINT;
+                return;
+            }
+        }
+    }
+}
+
+static void step(GdbStub* stub) {
+    run_block(stub, 1);
+    stub->signal =
+        stub->chip8->fault != FAULT_NONE ? GDB_SIGSEGV : GDB_SIGTRAP;
+}
+
+static unsigned int register_size(unsigned int reg) {
+    if (reg == GDB_REG_I || reg == GDB_REG_PC ||
+        (reg >= GDB_REG_STACK && reg < GDB_REG_DT))
+        return 2;
+    return 1;
+}
+
+static unsigned int read_gdb_register(Chip8* chip8, unsigned int reg) {
+    if (reg < GDB_REG_I)
+        return chip8->v[reg - GDB_REG_V0];
+    if (reg == GDB_REG_I)
+        return chip8->I;
+    if (reg == GDB_REG_PC)
+        return chip8->pc;
+    if (reg == GDB_REG_SP)
+        return chip8->stack.top;
+    if (reg < GDB_REG_DT)
+        return chip8->stack.data[reg - GDB_REG_STACK];
+    if (reg == GDB_REG_DT)
+        return read_delay_timer(chip8);
+    return read_sound_timer(chip8);
+}
+
+static int register_value_ok(unsigned int reg, unsigned int value) {
+    // The cores index their decoded code by pc, and a return address
+    // becomes the pc, so neither may point further than a run could go
+    if (reg == GDB_REG_PC || (reg >= GDB_REG_STACK && reg < GDB_REG_DT))
+        return valid_pc(value);
+    if (reg == GDB_REG_SP)
+        return value <= STACK_SIZE;
+    return TRUE;
+}
+
+static int write_gdb_register(Chip8* chip8,
+                              unsigned int reg,
+                              unsigned int value) {
+    // Returns FALSE, changing nothing, for a value the machine cannot hold
+    if (!register_value_ok(reg, value))
+        return FALSE;
+    if (reg < GDB_REG_I) {
+        chip8->v[reg - GDB_REG_V0] = value;
+    } else if (reg == GDB_REG_I) {
+        chip8->I = value;
+    } else if (reg == GDB_REG_PC) {
+        chip8->pc = value;
+    } else if (reg == GDB_REG_SP) {
+        chip8->stack.top = value;
+    } else if (reg < GDB_REG_DT) {
+        chip8->stack.data[reg - GDB_REG_STACK] = value;
+    } else if (reg == GDB_REG_DT) {
+        set_delay_timer(chip8, value);
+    } else {
+        set_sound_timer(chip8, value);
+    }
+    return TRUE;
+}
+
+static char* put_hex(char* out, unsigned int value, unsigned int size) {
+    // Little endian, two digits a byte
+    for (unsigned int i = 0; i < size; i++) {
+        uint8_t byte = value >> (8 * i);
+        *out++ = hex_digits[byte >> 4];
+        *out++ = hex_digits[byte & 0xF];
+    }
+    *out = '\0';
+    return out;
+}
+
+static int get_hex(const char* in, unsigned int size, unsigned int* value) {
+    *value = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        int high = hex_value(in[2 * i]);
+        int low = high >= 0 ? hex_value(in[2 * i + 1]) : -1;
+        if (low < 0)
+            return FALSE;
+        *value |= (unsigned int)(high << 4 | low) << (8 * i);
+    }
+    return TRUE;
+}
+
+static int parse_number(const char* in,
+                        char end,
+                        const char** rest,
+                        unsigned long* value) {
+    // A hex number followed by end, which may be '\0'
+    char* stop;
+    if (hex_value(*in) < 0)
+        return FALSE;
+    *value = strtoul(in, &stop, 16);
+    if (*stop != end)
+        return FALSE;
+    *rest = end ? stop + 1 : stop;
+    return TRUE;
+}
+
+static void register_name(unsigned int reg, char* name, size_t size) {
+    if (reg < GDB_REG_I) {
+        snprintf(name, size, "v%x", reg - GDB_REG_V0);
+    } else if (reg == GDB_REG_I) {
+        snprintf(name, size, "%s", "i");
+    } else if (reg == GDB_REG_PC) {
+        snprintf(name, size, "%s", "pc");
+    } else if (reg == GDB_REG_SP) {
+        snprintf(name, size, "%s", "sp");
+    } else if (reg < GDB_REG_DT) {
+        snprintf(name, size, "s%u", reg - GDB_REG_STACK);
+    } else {
+        snprintf(name, size, "%s", reg == GDB_REG_DT ? "dt" : "st");
+    }
+}
+
+static void build_target_xml(GdbStub* stub) {
+    // Register layout for debuggers that read target descriptions
+    char* out = stub->target_xml;
+    size_t left = sizeof(stub->target_xml);
+    int written = snprintf(out, left, "%s",
+                           "<?xml version=\"1.0\"?>\n"
+                           "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+                           "<target version=\"1.0\">\n"
+                           "<feature name=\"org.chip8.core\">\n");
+    for (unsigned int reg = 0; reg < GDB_NUM_REGS; reg++) {
+        // s and the digits of any unsigned int
+        char name[12];
+        unsigned int bits = 8 * register_size(reg);
+        out += written;
+        left -= written;
+        register_name(reg, name, sizeof(name));
+        written = snprintf(out, left,
+                           "<reg name=\"%s\" bitsize=\"%u\" "
+                           "type=\"uint%u\"/>\n",
+                           name, bits, bits);
+    }
+    snprintf(out + written, left - written, "%s", "</feature>\n</target>\n");
+}
+
+static void read_registers(GdbStub* stub, char* reply) {
+    for (unsigned int reg = 0; reg < GDB_NUM_REGS; reg++) {
+        reply = put_hex(reply, read_gdb_register(stub->chip8, reg),
+                        register_size(reg));
+    }
+}
+
+static int write_registers(GdbStub* stub, const char* data) {
+    unsigned int values[GDB_NUM_REGS];
+    for (unsigned int reg = 0; reg < GDB_NUM_REGS; reg++) {
+        unsigned int size = register_size(reg);
+        if (!get_hex(data, size, &values[reg]))
+            return FALSE;
+        if (!register_value_ok(reg, values[reg]))
+            return FALSE;
+        data += 2 * size;
+    }
+    if (*data != '\0')
+        return FALSE;
+    for (unsigned int reg = 0; reg < GDB_NUM_REGS; reg++) {
+        write_gdb_register(stub->chip8, reg, values[reg]);
+    }
+    return TRUE;
+}
+
+static int read_one_register(GdbStub* stub, const char* args, char* reply) {
+    unsigned long reg;
+    if (!parse_number(args, '\0', &args, &reg) || reg >= GDB_NUM_REGS)
+        return FALSE;
+    put_hex(reply, read_gdb_register(stub->chip8, reg), register_size(reg));
+    return TRUE;
+}
+
+static int write_one_register(GdbStub* stub, const char* args) {
+    unsigned long reg;
+    unsigned int value;
+    if (!parse_number(args, '=', &args, &reg) || reg >= GDB_NUM_REGS ||
+        !get_hex(args, register_size(reg), &value) ||
+        args[2 * register_size(reg)] != '\0')
+        return FALSE;
+    return write_gdb_register(stub->chip8, reg, value);
+}
+
+static int read_mem(GdbStub* stub, const char* args, char* reply) {
+    unsigned long addr, length;
+    if (!parse_number(args, ',', &args, &addr) ||
+        !parse_number(args, '\0', &args, &length) || addr > RAM_SIZE ||
+        length > RAM_SIZE - addr || length > GDB_PACKET_SIZE / 2)
+        return FALSE;
+    for (unsigned long i = 0; i < length; i++) {
+        reply = put_hex(reply, stub->chip8->mem[addr + i], 1);
+    }
+    return TRUE;
+}
+
+static int write_mem(GdbStub* stub, const char* args) {
+    unsigned char bytes[GDB_PACKET_SIZE / 2];
+    unsigned long addr, length;
+    if (!parse_number(args, ',', &args, &addr) ||
+        !parse_number(args, ':', &args, &length) || length > sizeof(bytes) ||
+        strlen(args) != 2 * length)
+        return FALSE;
+    for (unsigned long i = 0; i < length; i++) {
+        unsigned int byte;
+        if (!get_hex(args + 2 * i, 1, &byte))
+            return FALSE;
+        bytes[i] = byte;
+    }
+    // Goes through write_memory so decoded and translated code is dropped
+    return write_memory(stub->chip8, addr, bytes, length);
+}
+
+static int set_breakpoint(GdbStub* stub, const char* args, int set) {
+    // Software and hardware breakpoints are the same bit. Returns -1 for
+    // watchpoints, which are not supported.
+    unsigned long type, addr;
+    if (!parse_number(args, ',', &args, &type))
+        return FALSE;
+    if (type > 1)
+        return -1;
+    if (!parse_number(args, ',', &args, &addr) || addr >= RAM_SIZE)
+        return FALSE;
+    if (set) {
+        stub->breakpoints[addr / 64] |= (uint64_t)1 << (addr % 64);
+    } else {
+        stub->breakpoints[addr / 64] &= ~((uint64_t)1 << (addr % 64));
+    }
+    return TRUE;
+}
+
+static int read_target_xml(GdbStub* stub, const char* args, char* reply) {
+    unsigned long offset, length;
+    size_t size = strlen(stub->target_xml);
+    if (!parse_number(args, ',', &args, &offset) ||
+        !parse_number(args, '\0', &args, &length) || offset > size)
+        return FALSE;
+    if (length > GDB_PACKET_SIZE - 1)
+        length = GDB_PACKET_SIZE - 1;
+    if (length > size - offset)
+        length = size - offset;
+    reply[0] = offset + length < size ? 'm' : 'l';
+    memcpy(reply + 1, stub->target_xml + offset, length);
+    reply[1 + length] = '\0';
+    return TRUE;
+}
+
+static void query(GdbStub* stub, const char* packet, char* reply) {
+    static const char xfer[] = "qXfer:features:read:target.xml:";
+    if (strncmp(packet, "qSupported", 10) == 0) {
+        sprintf(reply, "PacketSize=%x;qXfer:features:read+",
+                GDB_PACKET_SIZE);
+    } else if (strcmp(packet, "qAttached") == 0) {
+        strcpy(reply, "1");
+    } else if (strncmp(packet, xfer, sizeof(xfer) - 1) == 0) {
+        if (!read_target_xml(stub, packet + sizeof(xfer) - 1, reply))
+            strcpy(reply, "E01");
+    }
+}
+
+static int resume_at(GdbStub* stub, const char* args) {
+    // c and s may give the address to carry on from
+    unsigned long addr;
+    if (*args == '\0')
+        return TRUE;
+    if (!parse_number(args, '\0', &args, &addr) || !valid_pc(addr))
+        return FALSE;
+    stub->chip8->pc = addr;
+    return TRUE;
+}
+
+static GdbResult serve_connection(GdbStub* stub) {
+    while (read_packet(stub)) {
+        const char* packet = stub->packet;
+        char* reply = stub->reply;
+        int ok = TRUE;
+        int result;
+
+        reply[0] = '\0';
+        switch (packet[0]) {
+            case '?':
+                sprintf(reply, "S%02x", stub->signal);
+                break;
+            case 'g':
+                read_registers(stub, reply);
+                break;
+            case 'G':
+                ok = write_registers(stub, packet + 1);
+                strcpy(reply, "OK");
+                break;
+            case 'p':
+                ok = read_one_register(stub, packet + 1, reply);
+                break;
+            case 'P':
+                ok = write_one_register(stub, packet + 1);
+                strcpy(reply, "OK");
+                break;
+            case 'm':
+                ok = read_mem(stub, packet + 1, reply);
+                break;
+            case 'M':
+                ok = write_mem(stub, packet + 1);
+                strcpy(reply, "OK");
+                break;
+            case 'c':
+            case 's':
+                ok = resume_at(stub, packet + 1);
+                if (!ok)
+                    break;
+                if (packet[0] == 'c') {
+                    resume(stub);
+                } else {
+                    step(stub);
+                }
+                if (stub->closed)
+                    return GDB_DETACHED;
+                sprintf(reply, "S%02x", stub->signal);
+                break;
+            case 'Z':
+            case 'z':
+                result = set_breakpoint(stub, packet + 1, packet[0] == 'Z');
+                ok = result != FALSE;
+                if (result == TRUE)
+                    strcpy(reply, "OK");
+                break;
+            case 'H':
+                strcpy(reply, "OK");
+                break;
+            case 'q':
+                query(stub, packet, reply);
+                break;
+            case 'k':
+                return GDB_KILLED;
+            case 'D':
+                send_packet(stub, "OK");
+                return GDB_DETACHED;
+            default:
+                // An empty reply tells the debugger the packet is unsupported
+                break;
+        }
+        if (!ok)
+            strcpy(reply, "E01");
+        if (!send_packet(stub, reply))
+            break;
+    }
+    // The debugger went away without detaching; the program carries on
+    return GDB_DETACHED;
+}
+
+static int listen_socket(const char* path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier run is replaced, any other file is
+    // not
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+GdbResult gdb_serve(Chip8* chip8,
+                    Chip8Core core,
+                    unsigned long ips,
+                    const char* path) {
+    GdbStub* stub = calloc(1, sizeof(GdbStub));
+    if (!stub) {
+        printf("%s\n", "Failed to allocate memory for debugger. Exiting.");
+        exit(-1);
+    }
+
+    int listen_fd = listen_socket(path);
+    if (listen_fd < 0) {
+        printf("Failed to listen for a debugger on %s.\n", path);
+        free(stub);
+        return GDB_ERROR;
+    }
+    printf("Waiting for a debugger on %s.\n", path);
+    fflush(stdout);
+    do {
+        stub->fd = accept(listen_fd, NULL, NULL);
+    } while (stub->fd < 0 && errno == EINTR);
+    close(listen_fd);
+    unlink(path);
+    if (stub->fd < 0) {
+        printf("Failed to accept a debugger on %s.\n", path);
+        free(stub);
+        return GDB_ERROR;
+    }
+
+    stub->chip8 = chip8;
+    stub->core = core;
+    stub->tick_cycles = ips / TIMER_HZ;
+    stub->until_tick = stub->tick_cycles;
+    stub->signal = GDB_SIGTRAP;
+    build_target_xml(stub);
+
+    GdbResult result = serve_connection(stub);
+    close(stub->fd);
+    free(stub);
+    return result;
+}
@@ -0,0 +1,42 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "chip8machine.h"
+
+// Register numbers in the GDB remote protocol, also the order of the g
+// packet. Every register is sent little endian.
+#define GDB_REG_V0 0
+// 16 bits
+#define GDB_REG_I 16
+// 16 bits
+#define GDB_REG_PC 17
+// 8 bits, the number of return addresses on the stack
+#define GDB_REG_SP 18
+// 16 bits each, STACK_SIZE of them from the bottom of the stack up
+#define GDB_REG_STACK 19
+#define GDB_REG_DT (GDB_REG_STACK + STACK_SIZE)
+#define GDB_REG_ST (GDB_REG_DT + 1)
+#define GDB_NUM_REGS (GDB_REG_ST + 1)
+
+typedef enum {
+    // The program carries on without the debugger
+    GDB_DETACHED,
+    GDB_KILLED,
+    GDB_ERROR,
+} GdbResult;
+
+// Waits for a debugger on a Unix socket at path and serves it, with the
+// machine stopped at pc until it continues or steps. Memory is the
+// machine's RAM, breakpoints are a bitmap of addresses. A tick of the timers
+// passes every ips / TIMER_HZ instructions run.
+//
+// The machine runs in blocks that end at control flow, at a memory write or
+// just before a breakpoint, and breakpoints are only checked between them,
+// so the cores are unchanged and nothing is paid once the debugger has
+// detached.
+GdbResult gdb_serve(Chip8* chip8,
+                    Chip8Core core,
+                    unsigned long ips,
+                    const char* path);
+
+#endif
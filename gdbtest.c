@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// Scripted client for chip8 -d: starts the emulator on a ROM, connects to
+// its stub and walks through a session the way gdb would, checking every
+// reply. Exits non-zero on the first one that is wrong.
+
+#define PACKET_SIZE 4096
+// The stub gets this many 10 ms tries to start listening
+#define CONNECT_ATTEMPTS 500
+// Longest wait for any reply
+#define REPLY_TIMEOUT_SEC 5
+// Offsets in the g reply, two hex digits a byte: v0-vf, then I, then pc
+#define G_V(x) (2 * (x))
+#define G_PC (2 * 16 + 4)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static pid_t start_stub(char* chip8, char* socket_path, char* rom) {
+    // Runs a short headless run under the stub, so it exits on detach
+    char* args[] = {chip8, "-b", "1000", "-d", socket_path, rom, NULL};
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(chip8, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_stub(const char* socket_path) {
+    struct sockaddr_un addr;
+    struct timeval timeout = {REPLY_TIMEOUT_SEC, 0};
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    for (unsigned int i = 0; i < CONNECT_ATTEMPTS; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof(timeout));
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int send_raw(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return FALSE;
+        data += sent;
+        size -= sent;
+    }
+    return TRUE;
+}
+
+static int send_packet(int fd, const char* body) {
+    char frame[PACKET_SIZE + 5];
+    size_t length = strlen(body);
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        sum += (uint8_t)body[i];
+    }
+    snprintf(frame, sizeof(frame), "$%s#%c%c", body, hex_digits[sum >> 4],
+             hex_digits[sum & 0xF]);
+    return send_raw(fd, frame, length + 4);
+}
+
+static int read_char(int fd) {
+    // Returns -1 on a timeout or once the stub has closed the connection
+    unsigned char c;
+    ssize_t got;
+    do {
+        got = recv(fd, &c, 1, 0);
+    } while (got < 0 && errno == EINTR);
+    return got == 1 ? c : -1;
+}
+
+static int read_reply(int fd, char* reply) {
+    // Skips the stub's acks, checks the checksum and acks the reply
+    int c;
+    do {
+        c = read_char(fd);
+        if (c < 0)
+            return FALSE;
+    } while (c != '$');
+
+    size_t length = 0;
+    uint8_t sum = 0;
+    while ((c = read_char(fd)) != '#') {
+        if (c < 0 || length == PACKET_SIZE)
+            return FALSE;
+        reply[length++] = c;
+        sum += (uint8_t)c;
+    }
+    reply[length] = '\0';
+    int high = read_char(fd);
+    int low = read_char(fd);
+    if (high != hex_digits[sum >> 4] || low != hex_digits[sum & 0xF])
+        return FALSE;
+    return send_raw(fd, "+", 1);
+}
+
+static int exchange(int fd, const char* body, char* reply) {
+    if (!send_packet(fd, body) || !read_reply(fd, reply)) {
+        printf("No reply to %s.\n", body);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int expect_reply(int fd, const char* body, const char* expected) {
+    char reply[PACKET_SIZE + 1];
+    if (!exchange(fd, body, reply))
+        return FALSE;
+    if (strcmp(reply, expected) != 0) {
+        printf("%s: expected %s, got %s.\n", body, expected, reply);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int expect_registers(int fd, int pc, int v7) {
+    // A negative pc or v7 leaves it unchecked
+    char reply[PACKET_SIZE + 1];
+    char field[5];
+    if (!exchange(fd, "g", reply))
+        return FALSE;
+    if (strlen(reply) < G_PC + 4 || reply[0] == 'E') {
+        printf("g: got %s.\n", reply);
+        return FALSE;
+    }
+    snprintf(field, sizeof(field), "%02x%02x", pc & 0xFF, (pc >> 8) & 0xFF);
+    if (pc >= 0 && strncmp(reply + G_PC, field, 4) != 0) {
+        printf("g: expected pc %s, got %.4s.\n", field, reply + G_PC);
+        return FALSE;
+    }
+    snprintf(field, sizeof(field), "%02x", v7 & 0xFF);
+    if (v7 >= 0 && strncmp(reply + G_V(7), field, 2) != 0) {
+        printf("g: expected v7 %s, got %.2s.\n", field, reply + G_V(7));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int expect_rom(int fd, const char* rom) {
+    // The first bytes of RAM at 0x200 have to be the ROM's
+    unsigned char bytes[4];
+    char expected[2 * sizeof(bytes) + 1];
+    FILE* file = fopen(rom, "rb");
+    if (!file || fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+        printf("Failed to read %s.\n", rom);
+        if (file)
+            fclose(file);
+        return FALSE;
+    }
+    fclose(file);
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        snprintf(expected + 2 * i, 3, "%02x", bytes[i]);
+    }
+    return expect_reply(fd, "m200,4", expected);
+}
+
+static int expect_out_of_range_pc(int fd) {
+    // Through P, through G with every other register as it was, and as the
+    // address of c and s
+    char registers[PACKET_SIZE + 2];
+    if (!expect_reply(fd, "P11=ffff", "E01") ||
+        !exchange(fd, "g", registers + 1))
+        return FALSE;
+    if (strlen(registers + 1) < G_PC + 4) {
+        printf("g: got %s.\n", registers + 1);
+        return FALSE;
+    }
+    registers[0] = 'G';
+    memcpy(registers + 1 + G_PC, "ffff", 4);
+    return expect_reply(fd, registers, "E01") &&
+           expect_reply(fd, "cffff", "E01") &&
+           expect_reply(fd, "s1000000", "E01");
+}
+
+static int run_session(int fd, const char* rom, int loop) {
+    char set[32], clear[32];
+    char reply[PACKET_SIZE + 1];
+    snprintf(set, sizeof(set), "Z0,%x,2", loop);
+    snprintf(clear, sizeof(clear), "z0,%x,2", loop);
+
+    // Stopped before the first instruction
+    if (!expect_reply(fd, "?", "S05") || !expect_registers(fd, 0x200, -1) ||
+        !expect_rom(fd, rom))
+        return FALSE;
+
+    // A pc past where any run can go is refused and changes nothing
+    if (!expect_out_of_range_pc(fd) || !expect_registers(fd, 0x200, -1))
+        return FALSE;
+
+    // Each continue stops on the next pass through the loop
+    if (!expect_reply(fd, set, "OK") || !expect_reply(fd, "c", "S05") ||
+        !expect_registers(fd, loop, 0) || !expect_reply(fd, "c", "S05") ||
+        !expect_registers(fd, loop, 1) || !expect_reply(fd, clear, "OK"))
+        return FALSE;
+
+    // Without the breakpoint it runs until interrupted. An ack ahead of
+    // the 0x03 must not hide it, and the session stays in step after.
+    if (!send_packet(fd, "c"))
+        return FALSE;
+    usleep(100000);
+    if (!send_raw(fd, "+\x03", 2) || !read_reply(fd, reply)) {
+        printf("%s\n", "No reply to the interrupt.");
+        return FALSE;
+    }
+    if (strcmp(reply, "S02") != 0) {
+        printf("Interrupt: expected S02, got %s.\n", reply);
+        return FALSE;
+    }
+    if (!expect_registers(fd, -1, -1) || !send_packet(fd, "c"))
+        return FALSE;
+
+    // A packet sent while it runs stops it as well, and is answered after
+    // the stop rather than lost
+    usleep(100000);
+    if (!send_packet(fd, "m200,4") || !read_reply(fd, reply)) {
+        printf("%s\n", "No stop for a packet sent while running.");
+        return FALSE;
+    }
+    if (strcmp(reply, "S02") != 0) {
+        printf("Packet while running: expected S02, got %s.\n", reply);
+        return FALSE;
+    }
+    if (!read_reply(fd, reply) || strlen(reply) != 8) {
+        printf("%s\n", "The packet sent while running was lost.");
+        return FALSE;
+    }
+    return expect_registers(fd, -1, -1) && expect_reply(fd, "D", "OK");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 5) {
+        printf("Usage: %s chip8 socket rom loop-address\n", argv[0]);
+        return 1;
+    }
+    int loop = strtol(argv[4], NULL, 16);
+
+    pid_t pid = start_stub(argv[1], argv[2], argv[3]);
+    if (pid < 0) {
+        printf("Failed to start %s.\n", argv[1]);
+        return 1;
+    }
+    int fd = connect_stub(argv[2]);
+    if (fd < 0) {
+        printf("Failed to connect to %s.\n", argv[2]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+
+    int passed = run_session(fd, argv[3], loop);
+    close(fd);
+    if (!passed)
+        kill(pid, SIGKILL);
+
+    // After the detach the run carries on headless and exits by itself
+    int status;
+    waitpid(pid, &status, 0);
+    if (passed && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        printf("%s\n", "chip8 did not exit cleanly after the detach.");
+        passed = FALSE;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,400 @@
+#include "icache.h"
+#include <stdio.h>
+#include "chip8machine.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+static void op_decode(Chip8* chip8, const DecodedInstr* d);
+
+const uint8_t fused_length[NUM_FUSED_OPS] = {
+    [OP_LD_I_DRW - OP_FUSED_FIRST] = 2,
+    [OP_LD_LD_DRW - OP_FUSED_FIRST] = 3,
+    [OP_ADD_SE_JP - OP_FUSED_FIRST] = 3,
+    [OP_LD_I_LOAD - OP_FUSED_FIRST] = 2,
+};
+
+static void op_nop(Chip8* chip8, const DecodedInstr* d) {
+    (void)chip8;
+    (void)d;
+}
+
+static void op_unhandled(Chip8* chip8, const DecodedInstr* d) {
+    unsigned int addr = d - chip8->icache;
+    printf("Unhandled instruction: %x.\n",
+           read_memory(chip8, addr) << 8 | read_memory(chip8, addr + 1));
+}
+
+static void op_cls(Chip8* chip8, const DecodedInstr* d) {
+    (void)d;
+    clear_screen(chip8);
+}
+
+static void op_ret(Chip8* chip8, const DecodedInstr* d) {
+    uint16_t addr;
+    (void)d;
+    if (stack_pop(&(chip8->stack), &addr)) {
+        chip8->pc = addr;
+    } else {
+        raise_fault(chip8, FAULT_STACK_UNDERFLOW);
+    }
+}
+
+static void op_jp(Chip8* chip8, const DecodedInstr* d) {
+    chip8->pc = d->nnn;
+}
+
+static void op_call(Chip8* chip8, const DecodedInstr* d) {
+    if (stack_push(&(chip8->stack), chip8->pc)) {
+        chip8->pc = d->nnn;
+    } else {
+        raise_fault(chip8, FAULT_STACK_OVERFLOW);
+    }
+}
+
+static void op_se_imm(Chip8* chip8, const DecodedInstr* d) {
+    if (chip8->v[d->x] == d->nn)
+        chip8->pc += 2;
+}
+
+static void op_sne_imm(Chip8* chip8, const DecodedInstr* d) {
+    if (chip8->v[d->x] != d->nn)
+        chip8->pc += 2;
+}
+
+static void op_se_reg(Chip8* chip8, const DecodedInstr* d) {
+    if (chip8->v[d->x] == chip8->v[d->y])
+        chip8->pc += 2;
+}
+
+static void op_sne_reg(Chip8* chip8, const DecodedInstr* d) {
+    if (chip8->v[d->x] != chip8->v[d->y])
+        chip8->pc += 2;
+}
+
+static void op_ld_imm(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] = d->nn;
+}
+
+static void op_add_imm(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] += d->nn;
+}
+
+static void op_ld_reg(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] = chip8->v[d->y];
+}
+
+static void op_or(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] |= chip8->v[d->y];
+}
+
+static void op_and(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] &= chip8->v[d->y];
+}
+
+static void op_xor(Chip8* chip8, const DecodedInstr* d) {
+    chip8->v[d->x] ^= chip8->v[d->y];
+}
+
+static void op_add_reg(Chip8* chip8, const DecodedInstr* d) {
+    uint16_t result = chip8->v[d->x] + chip8->v[d->y];
+    chip8->v[0xF] = result > 255 ? 1 : 0;
+    chip8->v[d->x] = result;
+}
+
+static void op_alu(Chip8* chip8, const DecodedInstr* d) {
+    // Subtractions and shifts keep going through the shared handler
+    instruction8_handler(d->x, d->y, d->n, chip8);
+}
+
+static void op_ld_i(Chip8* chip8, const DecodedInstr* d) {
+    chip8->I = d->nnn;
+}
+
+static void op_jp_v0(Chip8* chip8, const DecodedInstr* d) {
+    chip8->I = d->nnn + chip8->v[0x0];
+}
+
+static void op_rnd(Chip8* chip8, const DecodedInstr* d) {
+    random_register(chip8, d->x, d->nn);
+}
+
+static void op_drw(Chip8* chip8, const DecodedInstr* d) {
+    draw_sprite(chip8, d->x, d->y, d->n);
+}
+
+static void op_add_i(Chip8* chip8, const DecodedInstr* d) {
+    chip8->I += chip8->v[d->x];
+}
+
+static void op_misc(Chip8* chip8, const DecodedInstr* d) {
+    instructionF_handler(d->x, d->nn, chip8);
+}
+
+static void op_key(Chip8* chip8, const DecodedInstr* d) {
+    instructionE_handler(d->x, d->nn, chip8);
+}
+
+static void set_op(DecodedInstr* d, InstrHandler handler, DecodedOp op) {
+    d->handler = handler;
+    d->op = op;
+}
+
+void icache_decode(uint16_t instruction, DecodedInstr* d) {
+    d->x = (instruction & 0x0F00) >> 8;
+    d->y = (instruction & 0x00F0) >> 4;
+    d->n = instruction & 0x000F;
+    d->nn = instruction & 0x00FF;
+    d->nnn = instruction & 0x0FFF;
+
+    switch (instruction >> 12) {
+        case 0x0:
+            if (instruction == 0x00E0) {
+                set_op(d, op_cls, OP_CLS);
+            } else if (instruction == 0x00EE) {
+                set_op(d, op_ret, OP_RET);
+            } else {
+                set_op(d, op_nop, OP_NOP);
+            }
+            break;
+        case 0x1:
+            set_op(d, op_jp, OP_JP);
+            break;
+        case 0x2:
+            set_op(d, op_call, OP_CALL);
+            break;
+        case 0x3:
+            set_op(d, op_se_imm, OP_SE_IMM);
+            break;
+        case 0x4:
+            set_op(d, op_sne_imm, OP_SNE_IMM);
+            break;
+        case 0x5:
+            set_op(d, op_se_reg, OP_SE_REG);
+            break;
+        case 0x6:
+            set_op(d, op_ld_imm, OP_LD_IMM);
+            break;
+        case 0x7:
+            set_op(d, op_add_imm, OP_ADD_IMM);
+            break;
+        case 0x8:
+            switch (d->n) {
+                case 0x0:
+                    set_op(d, op_ld_reg, OP_LD_REG);
+                    break;
+                case 0x1:
+                    set_op(d, op_or, OP_OR);
+                    break;
+                case 0x2:
+                    set_op(d, op_and, OP_AND);
+                    break;
+                case 0x3:
+                    set_op(d, op_xor, OP_XOR);
+                    break;
+                case 0x4:
+                    set_op(d, op_add_reg, OP_ADD_REG);
+                    break;
+                default:
+                    set_op(d, op_alu, OP_ALU);
+                    break;
+            }
+            break;
+        case 0x9:
+            set_op(d, op_sne_reg, OP_SNE_REG);
+            break;
+        case 0xA:
+            set_op(d, op_ld_i, OP_LD_I);
+            break;
+        case 0xB:
+            set_op(d, op_jp_v0, OP_JP_V0);
+            break;
+        case 0xC:
+            set_op(d, op_rnd, OP_RND);
+            break;
+        case 0xD:
+            set_op(d, op_drw, OP_DRW);
+            break;
+        case 0xE:
+            set_op(d, op_key, OP_KEY);
+            break;
+        case 0xF:
+            if (d->nn == 0x1E) {
+                set_op(d, op_add_i, OP_ADD_I);
+            } else {
+                set_op(d, op_misc, OP_MISC);
+            }
+            break;
+        default:
+            set_op(d, op_unhandled, OP_UNHANDLED);
+            break;
+    }
+}
+
+#ifndef CHIP8_PROFILE
+static uint16_t instruction_at(Chip8* chip8, unsigned int addr) {
+    return (uint16_t)chip8->mem[addr] << 8 | chip8->mem[addr + 1];
+}
+
+static DecodedOp match_fused(Chip8* chip8, unsigned int addr) {
+    unsigned int available = (RAM_SIZE - addr) / 2;
+    uint16_t first = instruction_at(chip8, addr);
+    if (available < 2)
+        return OP_DECODE;
+    uint16_t second = instruction_at(chip8, addr + 2);
+
+    if (available >= 3) {
+        uint16_t third = instruction_at(chip8, addr + 4);
+        if (first >> 12 == 0x6 && second >> 12 == 0x6 && third >> 12 == 0xD)
+            return OP_LD_LD_DRW;
+        if (first >> 12 == 0x7 && second >> 12 == 0x3 && third >> 12 == 0x1)
+            return OP_ADD_SE_JP;
+    }
+    if (first >> 12 == 0xA && second >> 12 == 0xD)
+        return OP_LD_I_DRW;
+    if (first >> 12 == 0xA && (second & 0xF0FF) == 0xF065)
+        return OP_LD_I_LOAD;
+    return OP_DECODE;
+}
+#endif
+
+static void fuse(Chip8* chip8, unsigned int addr) {
+#ifndef CHIP8_PROFILE
+    // Peephole over the instructions following a freshly decoded one. The
+    // rest of a sequence is decoded in place for the fused handler to read.
+    DecodedOp fused = match_fused(chip8, addr);
+    if (fused == OP_DECODE)
+        return;
+    for (unsigned int i = 1; i < fused_length[fused - OP_FUSED_FIRST]; i++) {
+        unsigned int next = addr + 2 * i;
+        if (chip8->icache[next].op == OP_DECODE)
+            icache_decode(instruction_at(chip8, next), &chip8->icache[next]);
+    }
+    chip8->icache[addr].op = fused;
+#else
+    // Profile builds count every instruction, so nothing is fused
+    (void)chip8;
+    (void)addr;
+#endif
+}
+
+int icache_fill(Chip8* chip8, unsigned int addr) {
+    // Decode the instruction at addr into its slot, leaving pc after it. A
+    // slot past the end of RAM stays undecoded; the fetch has parked the
+    // machine on a fault there instead.
+    chip8->pc = addr;
+    uint16_t instruction = fetch(chip8);
+    if (addr >= RAM_SIZE - 1)
+        return FALSE;
+    icache_decode(instruction, &chip8->icache[addr]);
+    fuse(chip8, addr);
+    return TRUE;
+}
+
+static void op_decode(Chip8* chip8, const DecodedInstr* d) {
+    // First execution of this slot: decode it in place, then run it
+    if (icache_fill(chip8, d - chip8->icache))
+        d->handler(chip8, d);
+}
+
+void icache_init(Chip8* chip8) {
+    for (unsigned int i = 0; i < ICACHE_SIZE; i++) {
+        set_op(&chip8->icache[i], op_decode, OP_DECODE);
+    }
+}
+
+void icache_invalidate(Chip8* chip8,
+                       unsigned int addr,
+                       unsigned int num_bytes) {
+    // A fused sequence starting up to this many bytes earlier overlaps the
+    // first byte
+    unsigned int reach = 2 * FUSED_MAX_LENGTH - 1;
+    unsigned int start = addr > reach ? addr - reach : 0;
+    unsigned int end = addr + num_bytes;
+
+    if (end > RAM_SIZE)
+        end = RAM_SIZE;
+    for (unsigned int i = start; i < end; i++) {
+        set_op(&chip8->icache[i], op_decode, OP_DECODE);
+    }
+}
+
+unsigned int run_fused(Chip8* chip8, const DecodedInstr* d) {
+    // Each step leaves pc where the unfused instruction would, so a fault
+    // part way through parks the machine on the right instruction
+    const DecodedInstr* second = d + 2;
+    const DecodedInstr* third = d + 4;
+    unsigned int length = fused_length[d->op - OP_FUSED_FIRST];
+
+    switch (d->op) {
+        case OP_LD_I_DRW:
+            chip8->I = d->nnn;
+            chip8->pc += 2;
+            draw_sprite(chip8, second->x, second->y, second->n);
+            break;
+        case OP_LD_LD_DRW:
+            chip8->v[d->x] = d->nn;
+            chip8->v[second->x] = second->nn;
+            chip8->pc += 4;
+            draw_sprite(chip8, third->x, third->y, third->n);
+            break;
+        case OP_ADD_SE_JP:
+            chip8->v[d->x] += d->nn;
+            if (chip8->v[second->x] == second->nn) {
+                // Loop done: the jump is skipped
+                chip8->pc += 4;
+                length = 2;
+            } else {
+                chip8->pc = third->nnn;
+            }
+            break;
+        case OP_LD_I_LOAD:
+            chip8->I = d->nnn;
+            chip8->pc += 2;
+            load_memory(chip8, second->x);
+            break;
+        default:
+            d->handler(chip8, d);
+            return 1;
+    }
+    chip8->fusion_saved[d->op - OP_FUSED_FIRST] += length - 1;
+    return length;
+}
+
+const char* fused_name(DecodedOp op) {
+    switch (op) {
+        case OP_LD_I_DRW:
+            return "ANNN DXYN";
+        case OP_LD_LD_DRW:
+            return "6XNN 6YNN DXYN";
+        case OP_ADD_SE_JP:
+            return "7XNN 3XNN 1NNN";
+        case OP_LD_I_LOAD:
+            return "ANNN FX65";
+        default:
+            return "none";
+    }
+}
+
+void run_cached(Chip8* chip8, unsigned long cycles) {
+    while (cycles > 0) {
+        PROFILE_INSTRUCTION(chip8, chip8->pc);
+        const DecodedInstr* d = &chip8->icache[chip8->pc];
+        chip8->pc += 2;
+        if (d->op == OP_DECODE) {
+            // Decode in place first, so a sequence is fused from its first
+            // run as in the threaded core
+            if (!icache_fill(chip8, chip8->pc - 2)) {
+                cycles--;
+                continue;
+            }
+        }
+        if (d->op >= OP_FUSED_FIRST &&
+            fused_length[d->op - OP_FUSED_FIRST] <= cycles) {
+            cycles -= run_fused(chip8, d);
+        } else {
+            d->handler(chip8, d);
+            cycles--;
+        }
+    }
+}
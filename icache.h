@@ -0,0 +1,95 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+
+struct Chip8;
+struct DecodedInstr;
+
+typedef void (*InstrHandler)(struct Chip8* chip8,
+                             const struct DecodedInstr* d);
+
+// Operation tokens, used by cores that dispatch on something other than the
+// handler pointer. OP_DECODE marks a slot that has not been decoded yet.
+typedef enum {
+    OP_DECODE,
+    OP_NOP,
+    OP_UNHANDLED,
+    OP_CLS,
+    OP_RET,
+    OP_JP,
+    OP_CALL,
+    OP_SE_IMM,
+    OP_SNE_IMM,
+    OP_SE_REG,
+    OP_SNE_REG,
+    OP_LD_IMM,
+    OP_ADD_IMM,
+    OP_LD_REG,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_REG,
+    OP_ALU,
+    OP_LD_I,
+    OP_JP_V0,
+    OP_RND,
+    OP_DRW,
+    OP_ADD_I,
+    OP_MISC,
+    OP_KEY,
+    // Superinstructions: sequences common enough to run on one dispatch. The
+    // first instruction's slot gets the sequence's op, but its handler still
+    // runs that instruction alone. The rest keep their own decodes, which
+    // the fused code reads its operands from.
+    // ANNN DXYN
+    OP_LD_I_DRW,
+    // 6XNN 6YNN DXYN
+    OP_LD_LD_DRW,
+    // 7XNN 3XNN 1NNN, a counted loop
+    OP_ADD_SE_JP,
+    // ANNN FX65
+    OP_LD_I_LOAD,
+    OP_COUNT
+} DecodedOp;
+
+#define OP_FUSED_FIRST OP_LD_I_DRW
+#define NUM_FUSED_OPS (OP_COUNT - OP_FUSED_FIRST)
+// Longest sequence fused, in instructions
+#define FUSED_MAX_LENGTH 3
+
+// An instruction with its operands already extracted, ready to execute
+typedef struct DecodedInstr {
+    InstrHandler handler;
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t nn;
+    uint8_t op;
+} DecodedInstr;
+
+// Instructions a fused sequence needs left in the budget to run as one,
+// by op from OP_FUSED_FIRST. With less, its first instruction runs alone.
+extern const uint8_t fused_length[NUM_FUSED_OPS];
+
+// Slots past the end of RAM, up to where a skip in the last instruction
+// lands, so a pc that runs off the end still finds a decode stub. Its fetch
+// then parks the machine on a fault.
+#define ICACHE_SIZE (RAM_SIZE + 3)
+
+void icache_init(struct Chip8* chip8);
+// Decodes a single instruction the way the cached cores do, without fusing
+void icache_decode(uint16_t instruction, DecodedInstr* d);
+// Returns FALSE if addr is past the end of RAM
+int icache_fill(struct Chip8* chip8, unsigned int addr);
+void icache_invalidate(struct Chip8* chip8,
+                       unsigned int addr,
+                       unsigned int num_bytes);
+void run_cached(struct Chip8* chip8, unsigned long cycles);
+// Runs the fused sequence starting at d, with pc already past its first
+// instruction. Returns the number of instructions it ran.
+unsigned int run_fused(struct Chip8* chip8, const DecodedInstr* d);
+const char* fused_name(DecodedOp op);
+
+#endif
@@ -0,0 +1,177 @@
+#include "inputlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define LOG_FRAME 0
+#define LOG_RANDOM 1
+#define LOG_FRAME_SIZE 7
+#define LOG_RANDOM_SIZE 2
+#define LOG_INITIAL_CAPACITY 4096
+
+static unsigned char* append(InputLog* log, size_t len) {
+    // Returns NULL once the log could not grow; it can no longer be written
+    if (log->failed)
+        return NULL;
+    if (log->used + len > log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2
+                                        : LOG_INITIAL_CAPACITY;
+        unsigned char* data = realloc(log->data, capacity);
+        if (!data) {
+            log->failed = TRUE;
+            return NULL;
+        }
+        log->data = data;
+        log->capacity = capacity;
+    }
+    unsigned char* record = log->data + log->used;
+    log->used += len;
+    return record;
+}
+
+static void start(InputLog* log, Chip8* chip8, uint64_t seed) {
+    memset(&log->header, 0, sizeof(log->header));
+    log->header.magic = INPUT_LOG_MAGIC;
+    log->header.version = INPUT_LOG_VERSION;
+    log->header.seed = seed;
+    log->diverged = FALSE;
+    log->pos = 0;
+    seed_random(chip8, seed);
+    log->header.start_hash = hash_machine(chip8);
+    chip8->input_log = log;
+}
+
+void input_log_record(InputLog* log, Chip8* chip8, uint64_t seed) {
+    log->data = NULL;
+    log->used = 0;
+    log->capacity = 0;
+    log->replaying = FALSE;
+    log->failed = FALSE;
+    start(log, chip8, seed);
+}
+
+int input_log_replay(InputLog* log, Chip8* chip8, const char* file_name) {
+    InputLogHeader header;
+    FILE* f = fopen(file_name, "rb");
+    if (!f)
+        return FALSE;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != INPUT_LOG_MAGIC ||
+        header.version != INPUT_LOG_VERSION) {
+        fclose(f);
+        return FALSE;
+    }
+
+    unsigned char* data = malloc(header.size ? header.size : 1);
+    if (!data) {
+        fclose(f);
+        return FALSE;
+    }
+    int complete = fread(data, 1, header.size, f) == header.size;
+    fclose(f);
+    if (!complete) {
+        free(data);
+        return FALSE;
+    }
+
+    start(log, chip8, header.seed);
+    if (log->header.start_hash != header.start_hash) {
+        // Recorded against another ROM or starting state
+        chip8->input_log = NULL;
+        free(data);
+        return FALSE;
+    }
+    log->header = header;
+    log->data = data;
+    log->used = header.size;
+    log->capacity = header.size;
+    log->replaying = TRUE;
+    log->failed = FALSE;
+    return TRUE;
+}
+
+int input_log_write(InputLog* log, Chip8* chip8, const char* file_name) {
+    if (log->failed)
+        return FALSE;
+    log->header.end_hash = hash_machine(chip8);
+    log->header.size = log->used;
+
+    FILE* f = fopen(file_name, "wb");
+    if (!f)
+        return FALSE;
+    size_t written = fwrite(&log->header, sizeof(log->header), 1, f);
+    if (log->used)
+        written += fwrite(log->data, log->used, 1, f);
+    else
+        written++;
+    return fclose(f) == 0 && written == 2;
+}
+
+void input_log_free(InputLog* log) {
+    free(log->data);
+    log->data = NULL;
+}
+
+static void skip_to(InputLog* log, unsigned char tag) {
+    // Drop records the machine did not ask for, which only happens once the
+    // run has stopped following the recording
+    while (log->pos < log->used && log->data[log->pos] != tag) {
+        log->diverged = TRUE;
+        log->pos +=
+            log->data[log->pos] == LOG_FRAME ? LOG_FRAME_SIZE : LOG_RANDOM_SIZE;
+    }
+}
+
+int input_log_frame(InputLog* log, Chip8* chip8, unsigned long* cycles) {
+    if (!log->replaying) {
+        unsigned char* record = append(log, LOG_FRAME_SIZE);
+        if (!record)
+            return TRUE;
+        record[0] = LOG_FRAME;
+        record[1] = chip8->keypad & 0xFF;
+        record[2] = chip8->keypad >> 8;
+        for (unsigned int i = 0; i < 4; i++) {
+            record[3 + i] = (*cycles >> (8 * i)) & 0xFF;
+        }
+        log->header.frames++;
+        return TRUE;
+    }
+
+    skip_to(log, LOG_FRAME);
+    if (log->pos + LOG_FRAME_SIZE > log->used)
+        return FALSE;
+    const unsigned char* record = log->data + log->pos;
+    log->pos += LOG_FRAME_SIZE;
+    chip8->keypad = record[1] | (uint16_t)record[2] << 8;
+    *cycles = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        *cycles |= (unsigned long)record[3 + i] << (8 * i);
+    }
+    return TRUE;
+}
+
+uint8_t input_log_random(InputLog* log, Chip8* chip8) {
+    // The generator advances either way so the machine's state, rng
+    // included, matches the recording
+    uint8_t rnd = next_random(chip8);
+    if (!log->replaying) {
+        unsigned char* record = append(log, LOG_RANDOM_SIZE);
+        if (!record)
+            return rnd;
+        record[0] = LOG_RANDOM;
+        record[1] = rnd;
+        return rnd;
+    }
+
+    if (log->pos + LOG_RANDOM_SIZE <= log->used &&
+        log->data[log->pos] == LOG_RANDOM) {
+        rnd = log->data[log->pos + 1];
+        log->pos += LOG_RANDOM_SIZE;
+    } else {
+        log->diverged = TRUE;
+    }
+    return rnd;
+}
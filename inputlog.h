@@ -0,0 +1,60 @@
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8machine.h"
+
+#define INPUT_LOG_MAGIC 0x4C493843  // "C8IL" in a little-endian file
+#define INPUT_LOG_VERSION 1
+
+// Every input a run does not get from its starting state: the keypad and
+// cycle budget of each 60 Hz frame and the value of each CXNN. Replaying a
+// log against the same starting state reproduces the run bit for bit, at
+// whatever speed the host manages.
+//
+// The body is a sequence of records, a tag byte followed by its payload:
+// a frame carries the keypad as 2 bytes and the frame's cycles as 4, a
+// random value is 1 byte. Multi-byte fields are little endian.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seed;
+    // hash_machine() before the first and after the last frame
+    uint64_t start_hash;
+    uint64_t end_hash;
+    uint64_t frames;
+    uint64_t size;
+} InputLogHeader;
+
+typedef struct InputLog {
+    InputLogHeader header;
+    int replaying;
+    // Replay read a record other than the one the machine asked for
+    int diverged;
+    // Recording ran out of memory and the log is incomplete
+    int failed;
+    unsigned char* data;
+    size_t used;
+    size_t capacity;
+    // Read position while replaying
+    size_t pos;
+} InputLog;
+
+// Starts recording from the machine's current state, reseeding it
+void input_log_record(InputLog* log, Chip8* chip8, uint64_t seed);
+// Loads a log and prepares the machine to replay it. Returns FALSE if the
+// file is unreadable, not a log or recorded from a different state.
+int input_log_replay(InputLog* log, Chip8* chip8, const char* file_name);
+// Seals the log with the machine's final state and writes it. Returns FALSE
+// if it cannot be written or recording ran out of memory.
+int input_log_write(InputLog* log, Chip8* chip8, const char* file_name);
+void input_log_free(InputLog* log);
+
+// Called at the start of each frame. Recording logs the keypad and cycles;
+// replaying applies the logged keypad and cycles, and returns FALSE once
+// the log has no frames left.
+int input_log_frame(InputLog* log, Chip8* chip8, unsigned long* cycles);
+uint8_t input_log_random(InputLog* log, Chip8* chip8);
+
+#endif
@@ -0,0 +1,496 @@
+#include "jit.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8machine.h"
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#if defined(CHIP8_JIT) && defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64
+#ifdef CHIP8_PROFILE
+// Counter increment and class store in front of every instruction
+#define JIT_PROFILE_CODE 14
+#else
+#define JIT_PROFILE_CODE 0
+#endif
+// Upper bound on the native code emitted for one block
+#define JIT_MAX_BLOCK_CODE (JIT_MAX_BLOCK * (40 + JIT_PROFILE_CODE) + 128)
+#define JIT_MAX_PATCHES 4096
+
+// Host register assignment while inside translated code:
+//   rbx  Chip8* machine
+//   r12  remaining cycle budget
+//   r13  I
+// The v registers stay in the machine struct and are used as memory operands.
+#define V_OFF(x) ((int32_t)(offsetof(Chip8, v) + (x)))
+#define I_OFF ((int32_t)offsetof(Chip8, I))
+#define PC_OFF ((int32_t)offsetof(Chip8, pc))
+#ifdef CHIP8_PROFILE
+#define COUNT_OFF(op) \
+    ((int32_t)(offsetof(Chip8, profile.counts) + (op) * sizeof(uint64_t)))
+#define CURRENT_OFF ((int32_t)offsetof(Chip8, profile.current))
+#endif
+
+typedef int64_t (*JitEnter)(Chip8* chip8, uint8_t* entry, int64_t budget);
+
+typedef struct {
+    // Offset of a rel32 in the code buffer that currently jumps to the exit
+    uint32_t site;
+    // Guest address it should jump to once that block is translated
+    uint16_t target;
+} JitPatch;
+
+typedef struct JitState {
+    uint8_t* code;
+    size_t used;
+    uint8_t* exit;
+    // Where blocks start, after the entry trampoline and exit stub
+    size_t blocks;
+    // The buffer is never writable and executable at once: it is read/write
+    // while emitting and flipped to read/execute before it is entered
+    int executable;
+    // Native entry point per guest address; code itself marks "interpret"
+    uint8_t* entry[RAM_SIZE];
+    // Guest bytes covered by at least one translated block
+    uint8_t translated[RAM_SIZE];
+    JitPatch patches[JIT_MAX_PATCHES];
+    unsigned int num_patches;
+} JitState;
+
+static void emit8(JitState* j, uint8_t byte) {
+    j->code[j->used++] = byte;
+}
+
+static void emit32(JitState* j, uint32_t word) {
+    memcpy(j->code + j->used, &word, 4);
+    j->used += 4;
+}
+
+static void patch32(JitState* j, size_t site, uint32_t word) {
+    memcpy(j->code + site, &word, 4);
+}
+
+static int32_t rel32(JitState* j, size_t site, const uint8_t* target) {
+    return (int32_t)(target - (j->code + site + 4));
+}
+
+// ModRM + disp32 for [rbx + disp] with the given reg field
+static void emit_mem(JitState* j, uint8_t reg, int32_t disp) {
+    emit8(j, 0x80 | (reg << 3) | 0x3);
+    emit32(j, (uint32_t)disp);
+}
+
+static int jit_protect(JitState* j, int executable) {
+    if (j->executable == executable)
+        return TRUE;
+    int prot = executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE;
+    if (mprotect(j->code, JIT_CODE_SIZE, prot) != 0)
+        return FALSE;
+    j->executable = executable;
+    return TRUE;
+}
+
+static void jit_reset(JitState* j) {
+    // Drops every block; the trampoline and exit stub stay as they are
+    j->used = j->blocks;
+    j->num_patches = 0;
+    memset(j->entry, 0, sizeof(j->entry));
+    memset(j->translated, 0, sizeof(j->translated));
+}
+
+static void emit_trampoline(JitState* j) {
+    // Entry trampoline: int64_t enter(Chip8* rdi, entry rsi, budget rdx)
+    emit8(j, 0x53);  // push rbx
+    emit8(j, 0x41);  // push r12
+    emit8(j, 0x54);
+    emit8(j, 0x41);  // push r13
+    emit8(j, 0x55);
+    emit8(j, 0x48);  // mov rbx, rdi
+    emit8(j, 0x89);
+    emit8(j, 0xFB);
+    emit8(j, 0x49);  // mov r12, rdx
+    emit8(j, 0x89);
+    emit8(j, 0xD4);
+    emit8(j, 0x44);  // movzx r13d, word [rbx + I]
+    emit8(j, 0x0F);
+    emit8(j, 0xB7);
+    emit_mem(j, 5, I_OFF);
+    emit8(j, 0xFF);  // jmp rsi
+    emit8(j, 0xE6);
+
+    // Exit stub: write back I and return the remaining budget
+    j->exit = j->code + j->used;
+    emit8(j, 0x66);  // mov [rbx + I], r13w
+    emit8(j, 0x44);
+    emit8(j, 0x89);
+    emit_mem(j, 5, I_OFF);
+    emit8(j, 0x4C);  // mov rax, r12
+    emit8(j, 0x89);
+    emit8(j, 0xE0);
+    emit8(j, 0x41);  // pop r13
+    emit8(j, 0x5D);
+    emit8(j, 0x41);  // pop r12
+    emit8(j, 0x5C);
+    emit8(j, 0x5B);  // pop rbx
+    emit8(j, 0xC3);  // ret
+    j->blocks = j->used;
+}
+
+static JitState* jit_state(Chip8* chip8) {
+    if (chip8->jit)
+        return chip8->jit;
+
+    JitState* j = calloc(1, sizeof(JitState));
+    if (!j)
+        return NULL;
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) {
+        free(j);
+        return NULL;
+    }
+    emit_trampoline(j);
+    jit_reset(j);
+    chip8->jit = j;
+    return j;
+}
+
+static int is_block(JitState* j, unsigned int addr) {
+    return addr < RAM_SIZE - 1 && j->entry[addr] && j->entry[addr] != j->code;
+}
+
+static void emit_jmp_exit(JitState* j) {
+    emit8(j, 0xE9);
+    emit32(j, 0);
+    patch32(j, j->used - 4, rel32(j, j->used - 4, j->exit));
+}
+
+// Leave the block for guest address target: chain straight into its
+// translation if there is one, otherwise exit and remember to patch later
+static void emit_exit(JitState* j, unsigned int target) {
+    emit8(j, 0xC7);  // mov dword [rbx + pc], target
+    emit_mem(j, 0, PC_OFF);
+    emit32(j, target);
+
+    emit8(j, 0xE9);  // jmp rel32
+    emit32(j, 0);
+    size_t site = j->used - 4;
+    if (is_block(j, target)) {
+        patch32(j, site, rel32(j, site, j->entry[target]));
+        return;
+    }
+    patch32(j, site, rel32(j, site, j->exit));
+    if (target < RAM_SIZE - 1 && j->num_patches < JIT_MAX_PATCHES) {
+        j->patches[j->num_patches].site = site;
+        j->patches[j->num_patches].target = target;
+        j->num_patches++;
+    }
+}
+
+static void emit_skip(JitState* j, uint8_t jcc, unsigned int addr) {
+    emit8(j, 0x0F);  // jcc rel32 to the skipping exit
+    emit8(j, jcc);
+    emit32(j, 0);
+    size_t site = j->used - 4;
+    emit_exit(j, addr + 2);
+    patch32(j, site, rel32(j, site, j->code + j->used));
+    emit_exit(j, addr + 4);
+}
+
+static void chain_pending(JitState* j, unsigned int addr) {
+    unsigned int i = 0;
+    while (i < j->num_patches) {
+        if (j->patches[i].target == addr) {
+            size_t site = j->patches[i].site;
+            patch32(j, site, rel32(j, site, j->entry[addr]));
+            j->patches[i] = j->patches[--j->num_patches];
+        } else {
+            i++;
+        }
+    }
+}
+
+#ifdef CHIP8_PROFILE
+static void emit_profile(JitState* j, uint16_t instruction) {
+    ProfileOpcode opcode = profile_opcode(instruction);
+    emit8(j, 0x48);  // inc qword [rbx + count]
+    emit8(j, 0xFF);
+    emit_mem(j, 0, COUNT_OFF(opcode));
+    emit8(j, 0xC6);  // mov byte [rbx + current], class
+    emit_mem(j, 0, CURRENT_OFF);
+    emit8(j, profile_opcode_class[opcode]);
+}
+#endif
+
+// Emits the instruction at addr. Returns FALSE if it is not translated, in
+// which case nothing was emitted and the block ends before it.
+static int emit_instruction(JitState* j,
+                            uint16_t instruction,
+                            unsigned int addr,
+                            int* ends_block) {
+    uint8_t x = (instruction & 0x0F00) >> 8;
+    uint8_t y = (instruction & 0x00F0) >> 4;
+    uint8_t n = instruction & 0x000F;
+    uint8_t nn = instruction & 0x00FF;
+    uint16_t nnn = instruction & 0x0FFF;
+
+    *ends_block = FALSE;
+    switch (instruction >> 12) {
+        case 0x0:
+            // 0NNN is a no-op; 00E0 and 00EE are interpreted
+            return instruction != 0x00E0 && instruction != 0x00EE;
+        case 0x1:
+            emit_exit(j, nnn);
+            *ends_block = TRUE;
+            return TRUE;
+        case 0x3:
+        case 0x4:
+            emit8(j, 0x80);  // cmp byte [v + x], nn
+            emit_mem(j, 7, V_OFF(x));
+            emit8(j, nn);
+            emit_skip(j, (instruction >> 12) == 0x3 ? 0x84 : 0x85, addr);
+            *ends_block = TRUE;
+            return TRUE;
+        case 0x5:
+        case 0x9:
+            emit8(j, 0x8A);  // mov al, [v + x]
+            emit_mem(j, 0, V_OFF(x));
+            emit8(j, 0x3A);  // cmp al, [v + y]
+            emit_mem(j, 0, V_OFF(y));
+            emit_skip(j, (instruction >> 12) == 0x5 ? 0x84 : 0x85, addr);
+            *ends_block = TRUE;
+            return TRUE;
+        case 0x6:
+            emit8(j, 0xC6);  // mov byte [v + x], nn
+            emit_mem(j, 0, V_OFF(x));
+            emit8(j, nn);
+            return TRUE;
+        case 0x7:
+            emit8(j, 0x80);  // add byte [v + x], nn
+            emit_mem(j, 0, V_OFF(x));
+            emit8(j, nn);
+            return TRUE;
+        case 0x8:
+            switch (n) {
+                case 0x0:
+                case 0x1:
+                case 0x2:
+                case 0x3: {
+                    // mov / or / and / xor [v + x], al
+                    static const uint8_t alu[] = {0x88, 0x08, 0x20, 0x30};
+                    emit8(j, 0x8A);  // mov al, [v + y]
+                    emit_mem(j, 0, V_OFF(y));
+                    emit8(j, alu[n]);
+                    emit_mem(j, 0, V_OFF(x));
+                    return TRUE;
+                }
+                case 0x4:
+                    emit8(j, 0x0F);  // movzx eax, byte [v + x]
+                    emit8(j, 0xB6);
+                    emit_mem(j, 0, V_OFF(x));
+                    emit8(j, 0x0F);  // movzx ecx, byte [v + y]
+                    emit8(j, 0xB6);
+                    emit_mem(j, 1, V_OFF(y));
+                    emit8(j, 0x01);  // add eax, ecx
+                    emit8(j, 0xC8);
+                    emit8(j, 0x3D);  // cmp eax, 255
+                    emit32(j, 255);
+                    emit8(j, 0x0F);  // seta dl
+                    emit8(j, 0x97);
+                    emit8(j, 0xC2);
+                    emit8(j, 0x88);  // mov [v + F], dl
+                    emit_mem(j, 2, V_OFF(0xF));
+                    emit8(j, 0x88);  // mov [v + x], al
+                    emit_mem(j, 0, V_OFF(x));
+                    return TRUE;
+                default:
+                    return FALSE;
+            }
+        case 0xA:
+            emit8(j, 0x41);  // mov r13d, nnn
+            emit8(j, 0xBD);
+            emit32(j, nnn);
+            return TRUE;
+        case 0xB:
+            emit8(j, 0x0F);  // movzx eax, byte [v + 0]
+            emit8(j, 0xB6);
+            emit_mem(j, 0, V_OFF(0));
+            emit8(j, 0x44);  // lea r13d, [rax + nnn]
+            emit8(j, 0x8D);
+            emit8(j, 0xA8);
+            emit32(j, nnn);
+            return TRUE;
+        case 0xF:
+            if (nn != 0x1E)
+                return FALSE;
+            emit8(j, 0x0F);  // movzx eax, byte [v + x]
+            emit8(j, 0xB6);
+            emit_mem(j, 0, V_OFF(x));
+            emit8(j, 0x41);  // add r13d, eax
+            emit8(j, 0x01);
+            emit8(j, 0xC5);
+            emit8(j, 0x41);  // and r13d, 0xFFFF
+            emit8(j, 0x81);
+            emit8(j, 0xE5);
+            emit32(j, 0xFFFF);
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+static uint8_t* jit_compile(Chip8* chip8, JitState* j, unsigned int start) {
+    // Interpreted for now if the buffer cannot be made writable
+    if (!jit_protect(j, FALSE))
+        return j->code;
+    if (j->used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE)
+        jit_reset(j);
+
+    size_t block_start = j->used;
+    unsigned int addr = start;
+    unsigned int len = 0;
+    int ends_block = FALSE;
+
+    // Prologue: charge the whole block against the budget up front
+    emit8(j, 0x49);  // sub r12, len
+    emit8(j, 0x81);
+    emit8(j, 0xEC);
+    emit32(j, 0);
+    size_t len_site = j->used - 4;
+    emit8(j, 0x0F);  // jl bail
+    emit8(j, 0x8C);
+    emit32(j, 0);
+    size_t bail_site = j->used - 4;
+
+    while (!ends_block && len < JIT_MAX_BLOCK && addr < RAM_SIZE - 1) {
+        uint16_t instruction =
+            ((uint16_t)chip8->mem[addr] << 8) | chip8->mem[addr + 1];
+#ifdef CHIP8_PROFILE
+        size_t profile_start = j->used;
+        emit_profile(j, instruction);
+        if (!emit_instruction(j, instruction, addr, &ends_block)) {
+            j->used = profile_start;
+            break;
+        }
+#else
+        if (!emit_instruction(j, instruction, addr, &ends_block))
+            break;
+#endif
+        len++;
+        addr += 2;
+    }
+
+    if (len == 0) {
+        j->used = block_start;
+        j->entry[start] = j->code;
+        return j->code;
+    }
+    if (!ends_block)
+        emit_exit(j, addr);
+
+    // Bail: not enough budget left for the whole block, let the caller
+    // finish the remaining cycles in the interpreter
+    patch32(j, bail_site, rel32(j, bail_site, j->code + j->used));
+    emit8(j, 0x49);  // add r12, len
+    emit8(j, 0x81);
+    emit8(j, 0xC4);
+    emit32(j, len);
+    emit8(j, 0xC7);  // mov dword [rbx + pc], start
+    emit_mem(j, 0, PC_OFF);
+    emit32(j, start);
+    emit_jmp_exit(j);
+    patch32(j, len_site, len);
+
+    memset(j->translated + start, 1, addr - start);
+    j->entry[start] = j->code + block_start;
+    chain_pending(j, start);
+    return j->entry[start];
+}
+
+void run_jit(Chip8* chip8, unsigned long cycles) {
+    JitState* j = jit_state(chip8);
+    if (!j) {
+        run_cached(chip8, cycles);
+        return;
+    }
+
+    JitEnter enter = (JitEnter)j->code;
+    int64_t remaining = cycles;
+    while (remaining > 0) {
+        unsigned int pc = chip8->pc;
+        uint8_t* entry = pc < RAM_SIZE - 1 ? j->entry[pc] : j->code;
+        if (!entry)
+            entry = jit_compile(chip8, j, pc);
+        if (entry == j->code) {
+            // Not translatable here, interpret a single instruction
+            run_cached(chip8, 1);
+            remaining--;
+            continue;
+        }
+
+        if (!jit_protect(j, TRUE)) {
+            run_cached(chip8, remaining);
+            break;
+        }
+        int64_t left = enter(chip8, entry, remaining);
+        if (left == remaining) {
+            // The next block is longer than what is left of the budget
+            run_cached(chip8, remaining);
+            break;
+        }
+        remaining = left;
+    }
+}
+
+void jit_invalidate(Chip8* chip8, unsigned int addr, unsigned int num_bytes) {
+    JitState* j = chip8->jit;
+    if (!j)
+        return;
+
+    // A write to any translated byte throws away all translations; blocks
+    // can be chained into from anywhere so they are not removed one by one
+    unsigned int start = addr > 0 ? addr - 1 : 0;
+    unsigned int end = addr + num_bytes;
+    if (end > RAM_SIZE)
+        end = RAM_SIZE;
+    for (unsigned int i = start; i < end; i++) {
+        if (j->translated[i]) {
+            jit_reset(j);
+            return;
+        }
+    }
+}
+
+void jit_free(Chip8* chip8) {
+    JitState* j = chip8->jit;
+    if (!j)
+        return;
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j);
+    chip8->jit = NULL;
+}
+
+#else
+
+void run_jit(Chip8* chip8, unsigned long cycles) {
+    run_cached(chip8, cycles);
+}
+
+void jit_invalidate(Chip8* chip8, unsigned int addr, unsigned int num_bytes) {
+    (void)chip8;
+    (void)addr;
+    (void)num_bytes;
+}
+
+void jit_free(Chip8* chip8) {
+    (void)chip8;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef JIT_H
+#define JIT_H
+
+struct Chip8;
+
+// Dynamic recompiler for x86-64. Guest basic blocks are translated on first
+// use and chained together; anything the translator does not handle runs on
+// the cached interpreter. On other hosts run_jit() is the cached interpreter.
+void run_jit(struct Chip8* chip8, unsigned long cycles);
+void jit_invalidate(struct Chip8* chip8,
+                    unsigned int addr,
+                    unsigned int num_bytes);
+void jit_free(struct Chip8* chip8);
+
+#endif
@@ -0,0 +1,126 @@
+#include "libchip8.h"
+#include <stdlib.h>
+#include <string.h>
+#include "chip8machine.h"
+
+struct Chip8Instance {
+    Chip8* machine;
+    Chip8Core core;
+    unsigned long ips;
+    uint64_t seed;
+    // Frame within the current second, so ips spreads over the frames
+    // without losing the remainder
+    unsigned int frame;
+};
+
+static Chip8Status machine_status(const Chip8* chip8) {
+    return chip8->fault == FAULT_NONE ? CHIP8_OK : CHIP8_ERROR_FAULT;
+}
+
+Chip8Status chip8_create(Chip8Instance** instance,
+                         Chip8Core core,
+                         unsigned long ips) {
+    if (!instance || core > CORE_TABLE || ips == 0)
+        return CHIP8_ERROR_INVALID_ARGUMENT;
+
+    Chip8Instance* created = calloc(1, sizeof(Chip8Instance));
+    if (!created)
+        return CHIP8_ERROR_NO_MEMORY;
+    created->machine = init_machine();
+    if (!created->machine) {
+        free(created);
+        return CHIP8_ERROR_NO_MEMORY;
+    }
+    created->core = core;
+    created->ips = ips;
+    *instance = created;
+    return CHIP8_OK;
+}
+
+void chip8_destroy(Chip8Instance* instance) {
+    if (!instance)
+        return;
+    free_machine(instance->machine);
+    free(instance);
+}
+
+Chip8Status chip8_load(Chip8Instance* instance,
+                       const unsigned char* rom,
+                       size_t size) {
+    if (!instance || (!rom && size > 0))
+        return CHIP8_ERROR_INVALID_ARGUMENT;
+
+    Chip8* chip8 = init_machine();
+    if (!chip8)
+        return CHIP8_ERROR_NO_MEMORY;
+    if (!load_rom_buffer(chip8, rom, size, 0x200)) {
+        free_machine(chip8);
+        return CHIP8_ERROR_ROM_TOO_LARGE;
+    }
+    seed_random(chip8, instance->seed);
+
+    free_machine(instance->machine);
+    instance->machine = chip8;
+    instance->frame = 0;
+    return CHIP8_OK;
+}
+
+void chip8_seed(Chip8Instance* instance, uint64_t seed) {
+    instance->seed = seed;
+    seed_random(instance->machine, seed);
+}
+
+Chip8Status chip8_step(Chip8Instance* instance, unsigned long cycles) {
+    if (!instance)
+        return CHIP8_ERROR_INVALID_ARGUMENT;
+    run_cycles(instance->machine, instance->core, cycles);
+    return machine_status(instance->machine);
+}
+
+Chip8Status chip8_run_frame(Chip8Instance* instance) {
+    if (!instance)
+        return CHIP8_ERROR_INVALID_ARGUMENT;
+
+    unsigned long long ips = instance->ips;
+    unsigned int frame = instance->frame;
+    unsigned long cycles = (frame + 1) * ips / CHIP8_FRAME_HZ -
+                           frame * ips / CHIP8_FRAME_HZ;
+    instance->frame = (frame + 1) % CHIP8_FRAME_HZ;
+
+    run_tick(instance->machine, instance->core, cycles);
+    tick_timers(instance->machine);
+    return machine_status(instance->machine);
+}
+
+void chip8_read_framebuffer(const Chip8Instance* instance,
+                            uint64_t rows[CHIP8_DISPLAY_HEIGHT]) {
+    memcpy(rows, instance->machine->display_buffer,
+           sizeof(instance->machine->display_buffer));
+}
+
+void chip8_set_keys(Chip8Instance* instance, uint16_t keys) {
+    instance->machine->keypad = keys;
+}
+
+int chip8_sound_active(const Chip8Instance* instance) {
+    return sound_active(instance->machine);
+}
+
+const char* chip8_status_name(Chip8Status status) {
+    switch (status) {
+        case CHIP8_OK:
+            return "ok";
+        case CHIP8_ERROR_NO_MEMORY:
+            return "out of memory";
+        case CHIP8_ERROR_INVALID_ARGUMENT:
+            return "invalid argument";
+        case CHIP8_ERROR_ROM_TOO_LARGE:
+            return "rom too large";
+        case CHIP8_ERROR_IO:
+            return "rom not readable";
+        case CHIP8_ERROR_FAULT:
+            return "program fault";
+        default:
+            return "unknown";
+    }
+}
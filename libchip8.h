@@ -0,0 +1,76 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Embeddable CHIP-8 machines behind an opaque handle. The only state the
+// library keeps outside its instances is the table core's dispatch table,
+// built once under pthread_once by the first run on that core and only read
+// after that. A process can run any number of instances at once, each on
+// its own thread. A single instance must not be used from two threads at
+// the same time.
+
+#define CHIP8_DISPLAY_WIDTH 64
+#define CHIP8_DISPLAY_HEIGHT 32
+#define CHIP8_FRAME_HZ 60
+
+// Interpreter cores selectable at runtime
+typedef enum {
+    CORE_SWITCH,
+    CORE_CACHED,
+    CORE_THREADED,
+    CORE_JIT,
+    // ROMs translated to C by chip8_aot and linked into the executable.
+    // Instances made through this API run the cached interpreter instead.
+    CORE_AOT,
+    // Dispatches every raw instruction through a 64K table of handlers
+    CORE_TABLE,
+} Chip8Core;
+
+typedef enum {
+    CHIP8_OK,
+    CHIP8_ERROR_NO_MEMORY,
+    CHIP8_ERROR_INVALID_ARGUMENT,
+    // The ROM does not fit between 0x200 and the end of RAM
+    CHIP8_ERROR_ROM_TOO_LARGE,
+    // A ROM file could not be opened or mapped
+    CHIP8_ERROR_IO,
+    // The program faulted; it stays parked on the faulting instruction
+    // until the next chip8_load()
+    CHIP8_ERROR_FAULT,
+} Chip8Status;
+
+typedef struct Chip8Instance Chip8Instance;
+
+// Creates an empty machine; chip8_run_frame() runs ips instructions a second
+Chip8Status chip8_create(Chip8Instance** instance,
+                         Chip8Core core,
+                         unsigned long ips);
+void chip8_destroy(Chip8Instance* instance);
+
+// Resets the machine and loads a ROM image at 0x200. On error the previous
+// machine is left as it was.
+Chip8Status chip8_load(Chip8Instance* instance,
+                       const unsigned char* rom,
+                       size_t size);
+// Seeds CXNN, now and after every later chip8_load()
+void chip8_seed(Chip8Instance* instance, uint64_t seed);
+
+// Runs cycles instructions without touching the timers
+Chip8Status chip8_step(Chip8Instance* instance, unsigned long cycles);
+// Runs one frame's share of ips, skipping any time the program spends
+// waiting on the timers or keypad, then ticks the timers
+Chip8Status chip8_run_frame(Chip8Instance* instance);
+
+// Copies the display out, one row per word with column 0 in the most
+// significant bit
+void chip8_read_framebuffer(const Chip8Instance* instance,
+                            uint64_t rows[CHIP8_DISPLAY_HEIGHT]);
+// One bit per hex key, bit n set while key n is held
+void chip8_set_keys(Chip8Instance* instance, uint16_t keys);
+int chip8_sound_active(const Chip8Instance* instance);
+
+const char* chip8_status_name(Chip8Status status);
+
+#endif
@@ -1,456 +1,711 @@
-#include <sys/types.h>
-#include "stack.h"
-#define RAM_SIZE 4096
-#define STACK_SIZE 32
-
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include "aot.h"
+#include "batch.h"
 #include "chip8machine.h"
+#include "gdbstub.h"
+#include "inputlog.h"
+#include "renderer.h"
+#include "rewind.h"
+#include "romcache.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "simd.h"
+#include "snapshot.h"
+
+#ifndef CHIP8_DEFAULT_CORE
+#define CHIP8_DEFAULT_CORE CORE_CACHED
+#endif
 
 #define TRUE (1 == 1)
 #define FALSE (1 != 1)
 
-unsigned char read_memory(Chip8* chip8, unsigned int addr) {
-    if (addr >= RAM_SIZE) {
-        printf("%s\n", "Memory access out of bounds. Exiting.");
-        exit(-1);
-    }
-    return chip8->mem[addr];
+double elapsed_seconds(const struct timespec* start,
+                       const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
 }
 
-void write_memory(Chip8* chip8,
-                  unsigned int addr,
-                  unsigned char* bytes,
-                  unsigned int num_bytes) {
-    if (addr + num_bytes >= RAM_SIZE) {
-        printf("%s\n", "Trying to write outside of RAM. Exiting.");
-        exit(-1);
+void run_guest(Chip8* chip8,
+               Chip8Core core,
+               unsigned long cycles,
+               GuestSampler* sampler) {
+    if (sampler) {
+        sampler_run(sampler, chip8, core, cycles);
+    } else {
+        run_cycles(chip8, core, cycles);
     }
+}
 
-    for (unsigned int i = 0; i < num_bytes; i++) {
-        chip8->mem[addr + i] = bytes[i];
+void report_fusion(Chip8* chip8, unsigned long cycles) {
+    // Dispatches the superinstructions saved over the run, by sequence
+    uint64_t total = 0;
+    for (unsigned int f = 0; f < NUM_FUSED_OPS; f++) {
+        total += chip8->fusion_saved[f];
+    }
+    printf("fused:        %llu dispatches removed (%.1f%%)\n",
+           (unsigned long long)total, cycles ? 100.0 * total / cycles : 0.0);
+    for (unsigned int f = 0; f < NUM_FUSED_OPS; f++) {
+        if (chip8->fusion_saved[f])
+            printf("  %-16s%llu\n", fused_name(OP_FUSED_FIRST + f),
+                   (unsigned long long)chip8->fusion_saved[f]);
     }
 }
 
-void load_rom(Chip8* chip8,
-              const char* rom_file_name,
-              const unsigned int addr) {
-    FILE* f = NULL;
-    if (rom_file_name) {
-        f = fopen(rom_file_name, "rb");
+double run_headless(Chip8* chip8,
+                    Chip8Core core,
+                    unsigned long cycles,
+                    unsigned long ips,
+                    Rewind* rewind,
+                    GuestSampler* sampler) {
+    // Run a fixed number of instructions without display, logging or sleep.
+    // Returns the measured instructions per second.
+    struct timespec start, end;
+
+    memset(chip8->fusion_saved, 0, sizeof(chip8->fusion_saved));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (rewind) {
+        // Record a frame every tick's worth of instructions
+        unsigned long frame_cycles = ips / TIMER_HZ;
+        for (unsigned long done = 0; done < cycles; done += frame_cycles) {
+            if (frame_cycles > cycles - done)
+                frame_cycles = cycles - done;
+            run_guest(chip8, core, frame_cycles, sampler);
+            rewind_record(rewind, chip8);
+        }
     } else {
-        f = fopen("ibm_logo.ch8", "rb");
+        run_guest(chip8, core, cycles, sampler);
     }
-
-    if (!f) {
-        printf("%s\n", "ROM file could not be opened. Quitting.");
-        exit(-1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_seconds(&start, &end);
+    double ips_measured = seconds > 0 ? cycles / seconds : 0.0;
+    printf("cycles:       %lu\n", cycles);
+    printf("wall time:    %.6f s\n", seconds);
+    printf("instr/sec:    %.0f\n", ips_measured);
+    printf("state hash:   %016llx\n",
+           (unsigned long long)hash_machine(chip8));
+    printf("display hash: %016llx\n",
+           (unsigned long long)hash_display(chip8));
+    if (chip8->fault != FAULT_NONE) {
+        printf("fault:        %s at %03x\n", fault_name(chip8->fault),
+               chip8->pc);
     }
-
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    rewind(f);
-
-    fread(chip8->mem + addr, 1, size, f);
-    chip8->pc = addr;
-
-    fclose(f);
-}
-
-void set_register(Chip8* chip8, uint8_t x, uint16_t nn) {
-    chip8->v[x] = nn;
+    if (core == CORE_CACHED || core == CORE_THREADED)
+        report_fusion(chip8, cycles);
+    return ips_measured;
 }
 
-unsigned char read_register(Chip8* chip8, uint8_t x) {
-    return chip8->v[x];
+int write_guest_profile(GuestSampler* sampler,
+                        Chip8* chip8,
+                        const char* file_name) {
+    FILE* out = fopen(file_name, "w");
+    if (!out) {
+        printf("Failed to write guest profile: %s\n", file_name);
+        return FALSE;
+    }
+    sampler_write_collapsed(sampler, chip8, out);
+    fclose(out);
+    return TRUE;
 }
 
-void add_to_register(Chip8* chip8, uint8_t x, uint16_t nn) {
-    unsigned char value = read_register(chip8, x);
-    set_register(chip8, x, value + nn);
+int replay_input_log(Chip8* chip8, Chip8Core core, InputLog* log) {
+    // Returns FALSE if the run did not end where the recording did
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long frames = run_replay(chip8, core);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_seconds(&start, &end);
+    uint64_t hash = hash_machine(chip8);
+    printf("frames:       %lu of %llu\n", frames,
+           (unsigned long long)log->header.frames);
+    printf("wall time:    %.6f s\n", seconds);
+    printf("frames/sec:   %.0f\n", seconds > 0 ? frames / seconds : 0.0);
+    printf("state hash:   %016llx\n", (unsigned long long)hash);
+    printf("display hash: %016llx\n",
+           (unsigned long long)hash_display(chip8));
+    if (log->diverged || hash != log->header.end_hash) {
+        printf("Replay diverged, recording ended on %016llx.\n",
+               (unsigned long long)log->header.end_hash);
+        return FALSE;
+    }
+    return TRUE;
 }
 
-uint16_t fetch(Chip8* chip8) {
-    unsigned char first_byte = read_memory(chip8, chip8->pc);
-    chip8->pc++;
-    unsigned char second_byte = read_memory(chip8, chip8->pc);
-    chip8->pc++;
-    uint16_t instruction = ((uint16_t)first_byte << 8 | second_byte);
-    return instruction;
+void report_rewind(Chip8* chip8, Rewind* rewind) {
+    // Time the longest seek back and return to the newest frame
+    struct timespec start, end;
+    unsigned long newest = rewind_newest(rewind);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rewind_seek(rewind, chip8, rewind_oldest(rewind));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t oldest_hash = hash_machine(chip8);
+    rewind_seek(rewind, chip8, newest);
+
+    printf("rewind:       %lu frames in %zu bytes\n",
+           newest - rewind_oldest(rewind) + 1, rewind->used);
+    printf("oldest frame: %lu, hash %016llx\n", rewind_oldest(rewind),
+           (unsigned long long)oldest_hash);
+    printf("seek time:    %.1f us\n", elapsed_seconds(&start, &end) * 1e6);
 }
 
-void clear_screen(Chip8* chip8) {
-    for (unsigned int i = 0; i < DISPLAY_SIZE; i++) {
-        chip8->display_buffer[i] = 0;
+int run_batch_mode(char** roms,
+                   unsigned int num_roms,
+                   unsigned int num_jobs,
+                   unsigned int num_threads,
+                   Chip8Core core,
+                   unsigned long cycles,
+                   const uint64_t* expected_state) {
+    // Returns FALSE if a ROM cannot be used, before anything runs, or if a
+    // job does not end on the expected state hash
+    BatchJob* jobs = calloc(num_jobs, sizeof(BatchJob));
+    struct timespec start, end;
+    RomCache cache;
+
+    if (!jobs) {
+        printf("%s\n", "Failed to allocate memory for jobs. Exiting.");
+        exit(-1);
     }
-}
+    // Every job of a ROM starts from the one shared mapping
+    rom_cache_init(&cache);
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        Chip8Status status =
+            rom_cache_get(&cache, roms[i % num_roms], &jobs[i].rom);
+        if (status != CHIP8_OK) {
+            printf("%s: %s\n", roms[i % num_roms], chip8_status_name(status));
+            rom_cache_free(&cache);
+            free(jobs);
+            return FALSE;
+        }
+        jobs[i].max_cycles = cycles;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_batch(jobs, num_jobs, num_threads, core, BATCH_QUANTUM);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-void display(Chip8* chip8) {
-    system("clear");
-    printf("%s", "  +");
-    for (int i = 0; i < DISPLAY_X; i++)
-        putchar('-');
-    printf("%s\n", "+");
-    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
-        printf("%2d|", row);
-        for (unsigned int col = 0; col < DISPLAY_X; col++) {
-            putchar(chip8->display_buffer[row * DISPLAY_X + col] ? '#' : ' ');
+    double seconds = elapsed_seconds(&start, &end);
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        total += jobs[i].cycles;
+    }
+    printf("jobs:         %u on %u threads\n", num_jobs, num_threads);
+    printf("cycles:       %llu\n", total);
+    printf("wall time:    %.6f s\n", seconds);
+    printf("instr/sec:    %.0f\n", seconds > 0 ? total / seconds : 0.0);
+
+    // One summary line per ROM; jobs of the same ROM should agree
+    for (unsigned int r = 0; r < num_roms && r < num_jobs; r++) {
+        unsigned int count = 0;
+        unsigned int stuck = 0;
+        unsigned int faulted = 0;
+        unsigned int unloaded = 0;
+        int same_hash = TRUE;
+        for (unsigned int i = r; i < num_jobs; i += num_roms) {
+            count++;
+            if (jobs[i].halt_reason == HALT_STUCK)
+                stuck++;
+            if (jobs[i].halt_reason == HALT_FAULT)
+                faulted++;
+            if (jobs[i].halt_reason == HALT_LOAD_ERROR)
+                unloaded++;
+            if (jobs[i].state_hash != jobs[r].state_hash)
+                same_hash = FALSE;
+        }
+        printf("%s: %u jobs, %u stuck, %u faulted, %u not loaded, %u budget, ",
+               roms[r], count, stuck, faulted, unloaded,
+               count - stuck - faulted - unloaded);
+        if (same_hash) {
+            printf("state hash %016llx\n",
+                   (unsigned long long)jobs[r].state_hash);
+        } else {
+            printf("%s\n", "state hashes differ");
         }
+    }
 
-        printf("%s\n", "|");
+    int matched = TRUE;
+    for (unsigned int i = 0; i < num_jobs && expected_state; i++) {
+        if (jobs[i].state_hash != *expected_state)
+            matched = FALSE;
     }
+    if (!matched)
+        printf("State hash mismatch, expected %016llx.\n",
+               (unsigned long long)*expected_state);
 
-    printf("%s", "  +");
-    for (int i = 0; i < DISPLAY_X; i++)
-        putchar('-');
-    printf("%s\n", "+");
+    rom_cache_free(&cache);
+    free(jobs);
+    return matched;
 }
 
-unsigned char set_pixel(Chip8* chip8,
-                        uint16_t display_offset,
-                        unsigned char sprite_pixel) {
-    unsigned char current_pixel = chip8->display_buffer[display_offset];
-    unsigned char updated_pixel = 0;
-
-    if (current_pixel == 1 && sprite_pixel == 1) {
-        updated_pixel = 0;
-        set_register(chip8, 0xF, 1);
-    } else if (current_pixel == 0 && sprite_pixel == 1) {
-        updated_pixel = 1;
+void run_lockstep(const char* rom_file_name, unsigned long steps) {
+    // SIMD_LANES copies of one ROM stepped together by the vector stepper
+    Chip8* machines[SIMD_LANES];
+    Chip8Lanes lanes;
+    struct timespec start, end;
+
+    for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+        machines[lane] = init_machine();
+        if (!machines[lane] ||
+            !load_rom(machines[lane], rom_file_name, 0x200)) {
+            printf("%s\n", "ROM could not be loaded. Exiting.");
+            exit(-1);
+        }
+    }
+    lanes_init(&lanes, machines);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_lanes(&lanes, steps);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    lanes_sync(&lanes);
+
+    double seconds = elapsed_seconds(&start, &end);
+    unsigned long long total = 0;
+    int same_hash = TRUE;
+    uint64_t hash = hash_machine(machines[0]);
+    for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+        total += lanes.cycles[lane];
+        if (hash_machine(machines[lane]) != hash)
+            same_hash = FALSE;
+        free_machine(machines[lane]);
     }
 
-    chip8->display_buffer[display_offset] = updated_pixel;
+    printf("lanes:        %d\n", SIMD_LANES);
+    printf("steps:        %lu\n", steps);
+    printf("cycles:       %llu\n", total);
+    printf("wall time:    %.6f s\n", seconds);
+    printf("instr/sec:    %.0f\n", seconds > 0 ? total / seconds : 0.0);
+    if (same_hash) {
+        printf("state hash:   %016llx\n", (unsigned long long)hash);
+    } else {
+        printf("%s\n", "state hash:   lanes differ");
+    }
+}
 
+int parse_core(const char* name, Chip8Core* core) {
+    if (strcmp(name, "switch") == 0) {
+        *core = CORE_SWITCH;
+    } else if (strcmp(name, "cached") == 0) {
+        *core = CORE_CACHED;
+    } else if (strcmp(name, "threaded") == 0) {
+        *core = CORE_THREADED;
+    } else if (strcmp(name, "jit") == 0) {
+        *core = CORE_JIT;
+    } else if (strcmp(name, "aot") == 0) {
+        *core = CORE_AOT;
+    } else if (strcmp(name, "table") == 0) {
+        *core = CORE_TABLE;
+    } else {
+        return FALSE;
+    }
     return TRUE;
 }
 
-void draw_sprite(Chip8* chip8, uint8_t x, uint8_t y, uint8_t n) {
-    uint8_t loc_x = chip8->v[x];
-    uint8_t loc_y = chip8->v[y];
-
-    loc_x = loc_x % DISPLAY_X;
-    loc_y = loc_y % DISPLAY_Y;
-
-    set_register(chip8, 0xF, 0);
+void usage(const char* program) {
+    printf("Usage: %s [-b cycles] [-c core] [-i ips] [-r renderer]\n"
+           "          [-l state] [-s state] [-R mb] [-S seed] [-w log] [rom]\n",
+           program);
+    printf("       %s -b cycles -n jobs [-j threads] [-c core] rom...\n",
+           program);
+    printf("       %s -p log [-c core] [-l state] [rom]\n", program);
+    printf("%s\n", "  -b cycles  run headless for a fixed number of cycles");
+    printf("%s\n",
+           "  -d socket  wait for gdb on a Unix socket and run under it until "
+           "it detaches");
+    printf("%s\n",
+           "  -c core    interpreter core: switch, cached, threaded, jit, "
+           "aot, table");
+    printf("  -i ips     instructions per second (default %d)\n", DEFAULT_IPS);
+    printf("%s\n",
+           "  -r name    renderer: delta (default), or full to clear and "
+           "redraw");
+    printf("%s\n",
+           "  -n jobs    run a batch of machines, cycling through the roms");
+    printf("%s\n", "  -j threads worker threads for -n (default: all cores)");
+    printf("%s\n",
+           "  -L         with -b, step copies of the rom in SIMD lockstep");
+    printf("%s\n", "  -l file    start from a saved state instead of a rom");
+    printf("%s\n", "  -s file    with -b, save the state after the run");
+    printf("%s\n",
+           "  -R mb      keep mb megabytes of rewind history, one per frame");
+    printf("%s\n",
+           "  -B frames  with -b and -R, rewind this many frames before the "
+           "checks");
+    printf("%s\n",
+           "  -S seed    seed the random numbers (default: the clock, or "
+           "fixed with -b)");
+    printf("%s\n", "  -w file    record keypad and random inputs to a log");
+    printf("%s\n", "  -p file    replay a recorded log headless");
+    printf("%s\n",
+           "  -e hash    with -b, fail unless the display hash matches");
+    printf("%s\n",
+           "  -E hash    with -b, fail unless the state hash matches");
+    printf("%s\n",
+           "  -m ips     with -b, fail below this many instructions/sec");
+    printf("%s\n",
+           "  -g file    write sampled guest call stacks in collapsed format");
+    printf("  -G cycles  cycles between guest samples (default %d)\n",
+           SAMPLER_DEFAULT_INTERVAL);
+    printf("%s\n",
+           "  -y file    name guest addresses from an address/name list");
+#ifdef CHIP8_PROFILE
+    printf("%s\n",
+           "  -P file    write opcode counts as JSON at exit and on SIGUSR1, "
+           "- for stderr; every core but aot");
+#endif
+}
 
-    for (unsigned int row = 0; row < n; row++) {
-        if (loc_y + row >= DISPLAY_Y)
-            break;
-        unsigned char sprite_byte = read_memory(chip8, chip8->I + row);
-        for (unsigned int b = 0; b < 8; b++) {
-            // each bit in a byte is a pixel of the row in the sprite
-            uint16_t display_offset = (loc_y + row) * DISPLAY_X + loc_x + b;
-            if (loc_x + b >= DISPLAY_X)
+int main(int argc, char** argv) {
+    unsigned long bench_cycles = 0;
+    Chip8Core core = CHIP8_DEFAULT_CORE;
+    unsigned long ips = DEFAULT_IPS;
+    int full_redraw = FALSE;
+    unsigned int num_jobs = 0;
+    int lockstep = FALSE;
+    char* load_file_name = NULL;
+    char* save_file_name = NULL;
+    size_t rewind_size = 0;
+    unsigned long rewind_frames = 0;
+    int profile = FALSE;
+    char* guest_profile_file_name = NULL;
+    unsigned long sample_interval = SAMPLER_DEFAULT_INTERVAL;
+    char* symbol_file_name = NULL;
+#ifdef CHIP8_PROFILE
+    char* profile_file_name = NULL;
+#endif
+    int seed_given = FALSE;
+    uint64_t seed = 0;
+    char* record_file_name = NULL;
+    char* replay_file_name = NULL;
+    char* debug_socket = NULL;
+    int check_hash = FALSE;
+    uint64_t expected_hash = 0;
+    int check_state = FALSE;
+    uint64_t expected_state = 0;
+    double min_ips = 0;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    const char* options = "b:B:c:d:e:E:g:G:i:j:l:Lm:n:p:P:r:R:s:S:w:y:h";
+    while ((opt = getopt(argc, argv, options)) != -1) {
+        switch (opt) {
+            case 'b':
+                bench_cycles = strtoul(optarg, NULL, 0);
                 break;
-            unsigned char sprite_pixel = (sprite_byte >> (7 - b)) & 1;
-
-            set_pixel(chip8, display_offset, sprite_pixel);
+            case 'B':
+                rewind_frames = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                if (!parse_core(optarg, &core)) {
+                    printf("Unknown core: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                debug_socket = optarg;
+                break;
+            case 'e':
+                check_hash = TRUE;
+                expected_hash = strtoull(optarg, NULL, 16);
+                break;
+            case 'E':
+                check_state = TRUE;
+                expected_state = strtoull(optarg, NULL, 16);
+                break;
+            case 'g':
+                guest_profile_file_name = optarg;
+                break;
+            case 'G':
+                sample_interval = strtoul(optarg, NULL, 0);
+                if (sample_interval == 0) {
+                    printf("%s\n", "Sample interval must be at least 1.");
+                    return 1;
+                }
+                break;
+            case 'i':
+                ips = strtoul(optarg, NULL, 0);
+                if (ips < TIMER_HZ) {
+                    printf("At least %d instructions per second needed.\n",
+                           TIMER_HZ);
+                    return 1;
+                }
+                break;
+            case 'j':
+                num_threads = strtol(optarg, NULL, 0);
+                break;
+            case 'l':
+                load_file_name = optarg;
+                break;
+            case 'L':
+                lockstep = TRUE;
+                break;
+            case 'm':
+                min_ips = strtod(optarg, NULL);
+                break;
+            case 'n':
+                num_jobs = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                replay_file_name = optarg;
+                break;
+            case 'P':
+                profile = TRUE;
+#ifdef CHIP8_PROFILE
+                if (strcmp(optarg, "-") != 0)
+                    profile_file_name = optarg;
+#endif
+                break;
+            case 'r':
+                if (strcmp(optarg, "full") == 0) {
+                    full_redraw = TRUE;
+                } else if (strcmp(optarg, "delta") != 0) {
+                    printf("Unknown renderer: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                rewind_size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+                break;
+            case 's':
+                save_file_name = optarg;
+                break;
+            case 'S':
+                seed_given = TRUE;
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'w':
+                record_file_name = optarg;
+                break;
+            case 'y':
+                symbol_file_name = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
         }
     }
-}
 
-void instruction8_handler(uint8_t x, uint8_t y, uint8_t n, Chip8* chip8) {
-    unsigned char vx = read_register(chip8, x);
-    unsigned char vy = read_register(chip8, y);
-    uint16_t result;
-
-    switch (n) {
-        case 0x0:
-            // Set
-            set_register(chip8, x, vy);
-            break;
-        case 0x1:
-            // Binary OR
-            set_register(chip8, x, vx | vy);
-            break;
-        case 0x2:
-            // Binary AND
-            set_register(chip8, x, vx & vy);
-            break;
-        case 0x3:
-            // Logical XOR
-            set_register(chip8, x, vx ^ vy);
-            break;
-        case 0x4:
-            // Add
-            result = vx + vy;
-            if (result > 255) {
-                set_register(chip8, 0xF, 1);
-            } else {
-                set_register(chip8, 0xF, 0);
-            }
-            set_register(chip8, 0xF, result > 255 ? 1 : 0);
-            set_register(chip8, x, result);
-            break;
-        case 0x5:
-            // Subtract VX-VY
-            result = vx - vy;
-            set_register(chip8, 0xF, result >= 0 ? 1 : 0);
-            set_register(chip8, x, result);
-            break;
-        case 0x7:
-            // Subtract VY-VX
-            result = vy - vx;
-            set_register(chip8, 0xF, result >= 0 ? 1 : 0);
-            set_register(chip8, x, result);
-            break;
-        case 0x6:
-            // VX = (VY >> 1) Right Shift
-            {
-                const unsigned char shifted_bit = (0x01 & vy);
-                set_register(chip8, 0xF, shifted_bit);
-                set_register(chip8, x, (vy >> 1));
-            }
-            break;
-        case 0xE:
-            // VX = (VY << 1) Left Shift
-            {
-                const unsigned char shifted_bit = (0x80 & vy) >> 7;
-                set_register(chip8, 0xF, shifted_bit);
-                set_register(chip8, x, (vy << 1));
-            }
-            break;
-        default:
-            printf("Unhandled instruction: 0x8%x%x%x.\n", x, y, n);
-            break;
+    if (rewind_frames && (!bench_cycles || !rewind_size)) {
+        printf("%s\n", "-B rewinds a headless run recorded with -R.");
+        return 1;
     }
-}
 
-void store_memory(Chip8* chip8, const unsigned char x) {
-    // Write value of each register from v0 to vx(inclusive) to successive
-    // addresses, starting at I
-
-    for (uint8_t n = 0; n <= x; n++) {
-        unsigned char value = read_register(chip8, n);
-        chip8->mem[chip8->I + n] = value;
+    if (debug_socket && (num_jobs || lockstep || replay_file_name)) {
+        printf("%s\n", "-d debugs a single machine, not -n, -L or -p.");
+        return 1;
     }
-}
 
-void load_memory(Chip8* chip8, const unsigned int x) {
-    // Load memory values from I to I+x and load them into registers from
-    // v0 to vx
-
-    for (uint8_t n = 0; n <= x; n++) {
-        unsigned char value = chip8->mem[chip8->I + n];
-        set_register(chip8, n, value);
+    if (num_jobs) {
+        if (!bench_cycles || optind >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (!run_batch_mode(argv + optind, argc - optind, num_jobs,
+                            num_threads > 0 ? num_threads : 1, core,
+                            bench_cycles,
+                            check_state ? &expected_state : NULL))
+            return 1;
+        return 0;
     }
-}
 
-void instructionF_handler(uint8_t x, uint16_t nn, Chip8* chip8) {
-    switch (nn) {
-        case 0x7:
-            // Set VX to current delay timer
-            set_register(chip8, x, chip8->delay_timer);
-            break;
-        case 0x15:
-            // Set delay timer to VX
-            chip8->delay_timer = read_register(chip8, x);
-            break;
-        case 0x18:
-            // Set sound timer to VX
-            chip8->sound_timer = read_register(chip8, x);
-            break;
-        case 0x33:
-            // Binary Coded Decimal Conversion
-            {
-                unsigned char value = read_register(chip8, x);
-                unsigned char d1 = (value / 100);
-                unsigned char d2 = ((value / 10) % 10);
-                unsigned char d3 = (value % 10);
-
-                chip8->mem[chip8->I] = d1;
-                chip8->mem[chip8->I + 1] = d2;
-                chip8->mem[chip8->I + 2] = d3;
-            }
-            break;
-        case 0x1E:
-            // Instruction register += VX;
-            chip8->I += read_register(chip8, x);
-            break;
-        case 0x55:
-            store_memory(chip8, x);
-            break;
-        case 0x65:
-            load_memory(chip8, x);
-            break;
-        default:
-            break;
+    if (lockstep) {
+        if (!bench_cycles) {
+            usage(argv[0]);
+            return 1;
+        }
+        run_lockstep(optind < argc ? argv[optind] : NULL, bench_cycles);
+        return 0;
     }
-}
 
-void decode(uint16_t instruction, Chip8* chip8) {
-    uint8_t w = (instruction & 0xF000) >> 12;
-    uint8_t x = (instruction & 0x0F00) >> 8;
-    uint8_t y = (instruction & 0x00F0) >> 4;
-    uint8_t n = instruction & 0x000F;
-    unsigned char nn = instruction & 0x00FF;
-    uint16_t nnn = instruction & 0x0FFF;
-
-    if (instruction == 0x00E0) {
-        // Clear Screen
-        clear_screen(chip8);
-    } else if (instruction == 0x00EE) {
-        // Return from Subroutine
-        chip8->pc = stack_pop(&(chip8->stack));
-    }
-
-    switch (w) {
-        case 0x0:
-            // 0NNN: Skip
-            break;
-        case 0x1:
-            // 1NNN: Unconditional Jump to NNN
-            chip8->pc = nnn;
-            break;
-        case 0x2:
-            // 2NNN: Call Subroutine at NNN
-            stack_push(&(chip8->stack), chip8->pc);
-            chip8->pc = nnn;
-            break;
-        case 0x3:
-            // 3XNN: Conditional Skip if VX==NN
-            if (read_register(chip8, x) == nn) {
-                chip8->pc++;
-                chip8->pc++;
-            }
-            break;
-        case 0x4:
-            // 4XNN: Conditional Skip if VX!=NN
-            if (read_register(chip8, x) != nn) {
-                chip8->pc++;
-                chip8->pc++;
-            }
-            break;
-        case 0x5:
-            // 5XY0: Conditional Skip if VX==VY
-            if (read_register(chip8, x) == read_register(chip8, y)) {
-                chip8->pc++;
-                chip8->pc++;
-            }
-            break;
-        case 0x6:
-            // set vx
-            set_register(chip8, x, nn);
-            break;
-        case 0x7:
-            // add nn to x
-            add_to_register(chip8, x, nn);
-            break;
-        case 0x8:
-            // logic and arithmetic
-            instruction8_handler(x, y, n, chip8);
-            break;
-        case 0x9:
-            // 9XY0: Conditional Skip if VX!=VY
-            if (read_register(chip8, x) != read_register(chip8, y)) {
-                chip8->pc++;
-                chip8->pc++;
-            }
-            break;
-        case 0xA:
-            // set index register
-            chip8->I = nnn;
-            break;
-        case 0xB:
-            // Jump with offset
-            {
-                const unsigned char v0 = read_register(chip8, 0x0);
-                chip8->I = nnn + v0;
-            }
-            break;
-        case 0xC:
-            // Generate Random Number
-            {
-                srand((unsigned)time(NULL));
-                const unsigned char rnd = rand() & nn;
-                set_register(chip8, x, rnd);
-            }
-            break;
-        case 0xD:
-            // draw DXYN
-            draw_sprite(chip8, x, y, n);
-            break;
-        case 0xF:
-            // Timer, Misc
-            instructionF_handler(x, nn, chip8);
-            break;
-        default:
-            printf("Unhandled instruction: %x.\n", instruction);
-            // getchar();
-            break;
-    }
-};
-
-void store_font(Chip8* chip8, unsigned int addr) {
-    unsigned char fontset[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
-        0x20, 0x60, 0x20, 0x20, 0x70,  // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80   // F
-    };
-    unsigned char* font = fontset;
-    write_memory(chip8, addr, font, 80);
-}
+    if (record_file_name && (bench_cycles || replay_file_name)) {
+        // Only the real-time run has frames to record
+        printf("%s\n", "-w records the interactive run only.");
+        return 1;
+    }
 
-Chip8* init_machine() {
-    Chip8* chip8 = malloc(sizeof(Chip8));
-    stack_init(&(chip8->stack), STACK_SIZE);
-    store_font(chip8, 0x50);
+    if (profile) {
+#ifdef CHIP8_PROFILE
+        if (core == CORE_AOT) {
+            // Translated code runs no PROFILE_INSTRUCTION, so every count
+            // would be zero
+            printf("%s\n", "-P cannot count opcodes on the aot core.");
+            return 1;
+        }
+        profile_start(profile_file_name);
+#else
+        printf("%s\n", "Profiling needs a build with CHIP8_PROFILE.");
+        return 1;
+#endif
+    }
 
-    return chip8;
-}
+    // init
+    Chip8* chip8 = init_machine();
+    if (!chip8) {
+        printf("%s\n", "Failed to allocate memory for machine. Exiting.");
+        return 1;
+    }
 
-unsigned char detect_stuck(unsigned int current_pc) {
-    static unsigned int prev_pc = 0xDEADBEEF;
+    char* rom_file_name = NULL;
+    if (optind < argc) {
+        rom_file_name = argv[optind];
+    }
 
-    if (prev_pc == current_pc) {
-        // Gibt doch sicher instructions, bei denen man nur den Timer abwartet?
-        printf("%s\n", "Program execution stuck.\n");
-        return TRUE;
-    } else {
-        prev_pc = current_pc;
+    if (load_file_name) {
+        const Chip8Snapshot* snapshot = map_snapshot_file(load_file_name);
+        if (!snapshot) {
+            printf("Invalid save state: %s\n", load_file_name);
+            return 1;
+        }
+        restore_snapshot(chip8, snapshot);
+        unmap_snapshot_file(snapshot);
+    } else if (!load_rom(chip8, rom_file_name, 0x200)) {
+        printf("%s\n",
+               "ROM file could not be opened or does not fit. Quitting.");
+        return 1;
+    }
+    if (seed_given)
+        seed_random(chip8, seed);
+    if (core == CORE_AOT &&
+        !aot_attach(chip8, aot_programs, num_aot_programs))
+        printf("%s\n",
+               "No ahead-of-time translation matches the rom, running it on "
+               "the cached core.");
+
+    if (debug_socket) {
+        // Once the debugger detaches the run goes on as it would have
+        // started, headless or interactive
+        GdbResult debugged = gdb_serve(chip8, core, ips, debug_socket);
+        if (debugged != GDB_DETACHED) {
+            free_machine(chip8);
+            return debugged == GDB_KILLED ? 0 : 1;
+        }
+    }
 
-        return FALSE;
+    InputLog input_log;
+    if (replay_file_name) {
+        if (!input_log_replay(&input_log, chip8, replay_file_name)) {
+            printf("Invalid input log for this state: %s\n",
+                   replay_file_name);
+            return 1;
+        }
+        int replayed = replay_input_log(chip8, core, &input_log);
+        input_log_free(&input_log);
+        free_machine(chip8);
+        return replayed ? 0 : 1;
     }
-}
 
-int main(int argc, char** argv) {
-    printf("%s\n", "Chip-8 Emulator");
+    Rewind rewind;
+    if (rewind_size) {
+        // Frame slots scale with the default's ratio of frames to bytes
+        unsigned long bytes_per_frame =
+            REWIND_DEFAULT_SIZE / REWIND_DEFAULT_FRAMES;
+        rewind_init(&rewind, rewind_size, rewind_size / bytes_per_frame);
+    }
 
-    // init
-    Chip8* chip8 = init_machine();
+    GuestSampler sampler;
+    GuestSampler* active_sampler = NULL;
+    if (guest_profile_file_name) {
+        sampler_init(&sampler, sample_interval);
+        if (symbol_file_name &&
+            !sampler_load_symbols(&sampler, symbol_file_name)) {
+            printf("Failed to read symbols: %s\n", symbol_file_name);
+            return 1;
+        }
+        active_sampler = &sampler;
+    }
 
-    char* rom_file_name = NULL;
-    if (argc == 2) {
-        rom_file_name = argv[1];
+    if (bench_cycles) {
+        double measured = run_headless(chip8, core, bench_cycles, ips,
+                                       rewind_size ? &rewind : NULL,
+                                       active_sampler);
+        int failed = FALSE;
+        if (rewind_size) {
+            report_rewind(chip8, &rewind);
+            // The checks and the save state below see the rewound state
+            if (rewind_frames &&
+                !rewind_seek(&rewind, chip8,
+                             rewind_newest(&rewind) - rewind_frames)) {
+                printf("%lu frames back is not in the rewind history.\n",
+                       rewind_frames);
+                failed = TRUE;
+            }
+            rewind_free(&rewind);
+        }
+        if (check_hash && hash_display(chip8) != expected_hash) {
+            printf("Display hash mismatch, expected %016llx.\n",
+                   (unsigned long long)expected_hash);
+            failed = TRUE;
+        }
+        if (check_state && hash_machine(chip8) != expected_state) {
+            printf("State hash mismatch, expected %016llx.\n",
+                   (unsigned long long)expected_state);
+            failed = TRUE;
+        }
+        if (measured < min_ips) {
+            printf("Throughput below %.0f instructions/sec.\n", min_ips);
+            failed = TRUE;
+        }
+        if (save_file_name) {
+            Chip8Snapshot snapshot;
+            memset(&snapshot, 0, sizeof(snapshot));
+            save_snapshot(chip8, &snapshot);
+            if (!write_snapshot_file(save_file_name, &snapshot)) {
+                printf("Failed to write save state: %s\n", save_file_name);
+                return 1;
+            }
+        }
+        if (active_sampler) {
+            if (!write_guest_profile(active_sampler, chip8,
+                                     guest_profile_file_name))
+                failed = TRUE;
+            sampler_free(active_sampler);
+        }
+#ifdef CHIP8_PROFILE
+        if (profile)
+            profile_report(&chip8->profile);
+#endif
+        free_machine(chip8);
+        return failed ? 1 : 0;
     }
 
-    load_rom(chip8, rom_file_name, 0x200);
-    int counter = 0;
+    printf("%s\n", "Chip-8 Emulator");
+    // The renderer writes to the fd directly, bypassing stdio
+    fflush(stdout);
+    Renderer renderer;
+    renderer_init(&renderer, STDOUT_FILENO, full_redraw);
+
+    // Games expect different numbers each time they are played
+    if (!seed_given)
+        seed = (uint64_t)time(NULL);
+    if (record_file_name) {
+        input_log_record(&input_log, chip8, seed);
+    } else {
+        seed_random(chip8, seed);
+    }
 
-    while (!detect_stuck(chip8->pc)) {
-        unsigned int instr = fetch(chip8);
-        printf("%3d Instruction: %4x\n", counter++, instr);
-        // getchar();
-        decode(instr, chip8);
-        display(chip8);
-        usleep(500);
+    run_scheduler(chip8, core, ips, &renderer, rewind_size ? &rewind : NULL,
+                  active_sampler);
+    if (active_sampler) {
+        write_guest_profile(active_sampler, chip8, guest_profile_file_name);
+        sampler_free(active_sampler);
+    }
+#ifdef CHIP8_PROFILE
+    if (profile)
+        profile_report(&chip8->profile);
+#endif
+    if (rewind_size)
+        rewind_free(&rewind);
+    if (record_file_name) {
+        if (!input_log_write(&input_log, chip8, record_file_name))
+            printf("Failed to write input log: %s\n", record_file_name);
+        input_log_free(&input_log);
     }
 
-    free(chip8);
+    free_machine(chip8);
 }
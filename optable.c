@@ -0,0 +1,327 @@
+#include "optable.h"
+#include <pthread.h>
+#include <stdio.h>
+#include "chip8machine.h"
+
+#define NNN(instruction) ((instruction) & 0x0FFF)
+#define NN(instruction) ((instruction) & 0x00FF)
+#define Y(instruction) (((instruction) & 0x00F0) >> 4)
+#define N(instruction) ((instruction) & 0x000F)
+
+// A handler for each VX, wrapping the inline template with x fixed
+#define X_HANDLER(name, x)                                       \
+    static void name##_##x(Chip8* chip8, uint16_t instruction) { \
+        name(chip8, instruction, x);                             \
+    }
+#define X_FAMILY(name)                                              \
+    X_HANDLER(name, 0x0)                                            \
+    X_HANDLER(name, 0x1)                                            \
+    X_HANDLER(name, 0x2)                                            \
+    X_HANDLER(name, 0x3)                                            \
+    X_HANDLER(name, 0x4)                                            \
+    X_HANDLER(name, 0x5)                                            \
+    X_HANDLER(name, 0x6)                                            \
+    X_HANDLER(name, 0x7)                                            \
+    X_HANDLER(name, 0x8)                                            \
+    X_HANDLER(name, 0x9)                                            \
+    X_HANDLER(name, 0xA)                                            \
+    X_HANDLER(name, 0xB)                                            \
+    X_HANDLER(name, 0xC)                                            \
+    X_HANDLER(name, 0xD)                                            \
+    X_HANDLER(name, 0xE)                                            \
+    X_HANDLER(name, 0xF)                                            \
+    static const OpcodeHandler name##_family[16] = {                \
+        name##_0x0, name##_0x1, name##_0x2, name##_0x3, name##_0x4, \
+        name##_0x5, name##_0x6, name##_0x7, name##_0x8, name##_0x9, \
+        name##_0xA, name##_0xB, name##_0xC, name##_0xD, name##_0xE, \
+        name##_0xF,                                                 \
+    };
+
+// Built by the first run_table() in the process, read-only after that
+static OpcodeHandler table[OPCODE_TABLE_SIZE];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void op_nop(Chip8* chip8, uint16_t instruction) {
+    (void)chip8;
+    (void)instruction;
+}
+
+static void op_trap(Chip8* chip8, uint16_t instruction) {
+    (void)chip8;
+    printf("Unhandled instruction: %x.\n", instruction);
+}
+
+static void op_cls(Chip8* chip8, uint16_t instruction) {
+    (void)instruction;
+    clear_screen(chip8);
+}
+
+static void op_ret(Chip8* chip8, uint16_t instruction) {
+    uint16_t addr;
+    (void)instruction;
+    if (stack_pop(&(chip8->stack), &addr)) {
+        chip8->pc = addr;
+    } else {
+        raise_fault(chip8, FAULT_STACK_UNDERFLOW);
+    }
+}
+
+static void op_jp(Chip8* chip8, uint16_t instruction) {
+    chip8->pc = NNN(instruction);
+}
+
+static void op_call(Chip8* chip8, uint16_t instruction) {
+    if (stack_push(&(chip8->stack), chip8->pc)) {
+        chip8->pc = NNN(instruction);
+    } else {
+        raise_fault(chip8, FAULT_STACK_OVERFLOW);
+    }
+}
+
+static void op_ld_i(Chip8* chip8, uint16_t instruction) {
+    chip8->I = NNN(instruction);
+}
+
+static void op_jp_v0(Chip8* chip8, uint16_t instruction) {
+    chip8->I = NNN(instruction) + chip8->v[0x0];
+}
+
+static inline void op_se_imm(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    if (chip8->v[x] == NN(instruction))
+        chip8->pc += 2;
+}
+X_FAMILY(op_se_imm)
+
+static inline void op_sne_imm(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    if (chip8->v[x] != NN(instruction))
+        chip8->pc += 2;
+}
+X_FAMILY(op_sne_imm)
+
+static inline void op_se_reg(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    if (chip8->v[x] == chip8->v[Y(instruction)])
+        chip8->pc += 2;
+}
+X_FAMILY(op_se_reg)
+
+static inline void op_sne_reg(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    if (chip8->v[x] != chip8->v[Y(instruction)])
+        chip8->pc += 2;
+}
+X_FAMILY(op_sne_reg)
+
+static inline void op_ld_imm(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] = NN(instruction);
+}
+X_FAMILY(op_ld_imm)
+
+static inline void op_add_imm(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] += NN(instruction);
+}
+X_FAMILY(op_add_imm)
+
+static inline void op_ld_reg(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] = chip8->v[Y(instruction)];
+}
+X_FAMILY(op_ld_reg)
+
+static inline void op_or(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] |= chip8->v[Y(instruction)];
+}
+X_FAMILY(op_or)
+
+static inline void op_and(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] &= chip8->v[Y(instruction)];
+}
+X_FAMILY(op_and)
+
+static inline void op_xor(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    chip8->v[x] ^= chip8->v[Y(instruction)];
+}
+X_FAMILY(op_xor)
+
+static inline void op_add_reg(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    uint16_t result = chip8->v[x] + chip8->v[Y(instruction)];
+    chip8->v[0xF] = result > 255 ? 1 : 0;
+    chip8->v[x] = result;
+}
+X_FAMILY(op_add_reg)
+
+static inline void op_alu(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    // Subtractions and shifts keep going through the shared handler
+    instruction8_handler(x, Y(instruction), N(instruction), chip8);
+}
+X_FAMILY(op_alu)
+
+static inline void op_rnd(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    random_register(chip8, x, NN(instruction));
+}
+X_FAMILY(op_rnd)
+
+static inline void op_drw(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    draw_sprite(chip8, x, Y(instruction), N(instruction));
+}
+X_FAMILY(op_drw)
+
+static inline void op_skp(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    if ((chip8->keypad >> (chip8->v[x] & 0xF)) & 1)
+        chip8->pc += 2;
+}
+X_FAMILY(op_skp)
+
+static inline void op_sknp(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    if (!((chip8->keypad >> (chip8->v[x] & 0xF)) & 1))
+        chip8->pc += 2;
+}
+X_FAMILY(op_sknp)
+
+static inline void op_ld_vx_dt(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    chip8->v[x] = read_delay_timer(chip8);
+}
+X_FAMILY(op_ld_vx_dt)
+
+static inline void op_misc(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    // Key wait and BCD keep going through the shared handler
+    instructionF_handler(x, NN(instruction), chip8);
+}
+X_FAMILY(op_misc)
+
+static inline void op_ld_dt(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    set_delay_timer(chip8, chip8->v[x]);
+}
+X_FAMILY(op_ld_dt)
+
+static inline void op_ld_st(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    set_sound_timer(chip8, chip8->v[x]);
+}
+X_FAMILY(op_ld_st)
+
+static inline void op_add_i(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    chip8->I += chip8->v[x];
+}
+X_FAMILY(op_add_i)
+
+static inline void op_store(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    store_memory(chip8, x);
+}
+X_FAMILY(op_store)
+
+static inline void op_load(Chip8* chip8, uint16_t instruction, uint8_t x) {
+    (void)instruction;
+    load_memory(chip8, x);
+}
+X_FAMILY(op_load)
+
+static OpcodeHandler classify(uint16_t instruction) {
+    uint8_t x = (instruction & 0x0F00) >> 8;
+
+    switch (instruction >> 12) {
+        case 0x0:
+            if (instruction == 0x00E0)
+                return op_cls;
+            if (instruction == 0x00EE)
+                return op_ret;
+            return op_nop;
+        case 0x1:
+            return op_jp;
+        case 0x2:
+            return op_call;
+        case 0x3:
+            return op_se_imm_family[x];
+        case 0x4:
+            return op_sne_imm_family[x];
+        case 0x5:
+            // The low nibble is not checked, as in the other cores
+            return op_se_reg_family[x];
+        case 0x6:
+            return op_ld_imm_family[x];
+        case 0x7:
+            return op_add_imm_family[x];
+        case 0x8:
+            switch (N(instruction)) {
+                case 0x0:
+                    return op_ld_reg_family[x];
+                case 0x1:
+                    return op_or_family[x];
+                case 0x2:
+                    return op_and_family[x];
+                case 0x3:
+                    return op_xor_family[x];
+                case 0x4:
+                    return op_add_reg_family[x];
+                case 0x5:
+                case 0x6:
+                case 0x7:
+                case 0xE:
+                    return op_alu_family[x];
+                default:
+                    return op_trap;
+            }
+        case 0x9:
+            return op_sne_reg_family[x];
+        case 0xA:
+            return op_ld_i;
+        case 0xB:
+            return op_jp_v0;
+        case 0xC:
+            return op_rnd_family[x];
+        case 0xD:
+            return op_drw_family[x];
+        case 0xE:
+            if (NN(instruction) == 0x9E)
+                return op_skp_family[x];
+            if (NN(instruction) == 0xA1)
+                return op_sknp_family[x];
+            return op_trap;
+        case 0xF:
+            switch (NN(instruction)) {
+                case 0x07:
+                    return op_ld_vx_dt_family[x];
+                case 0x0A:
+                case 0x33:
+                    return op_misc_family[x];
+                case 0x15:
+                    return op_ld_dt_family[x];
+                case 0x18:
+                    return op_ld_st_family[x];
+                case 0x1E:
+                    return op_add_i_family[x];
+                case 0x55:
+                    return op_store_family[x];
+                case 0x65:
+                    return op_load_family[x];
+                default:
+                    // FX29 and the rest are no-ops in every core
+                    return op_nop;
+            }
+    }
+    return op_trap;
+}
+
+static void build_table(void) {
+    for (unsigned int i = 0; i < OPCODE_TABLE_SIZE; i++) {
+        table[i] = classify(i);
+    }
+}
+
+const OpcodeHandler* opcode_table(void) {
+    pthread_once(&table_once, build_table);
+    return table;
+}
+
+void run_table(Chip8* chip8, unsigned long cycles) {
+    const OpcodeHandler* handlers = opcode_table();
+    for (unsigned long i = 0; i < cycles; i++) {
+        PROFILE_INSTRUCTION(chip8, chip8->pc);
+        // A fetch past the end of RAM faults and returns 0000, a no-op
+        uint16_t instruction = fetch(chip8);
+        handlers[instruction](chip8, instruction);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef OPTABLE_H
+#define OPTABLE_H
+
+#include <stdint.h>
+
+struct Chip8;
+
+typedef void (*OpcodeHandler)(struct Chip8* chip8, uint16_t instruction);
+
+// One handler per raw 16-bit instruction, so dispatch is a single load with
+// no decoding. VX is baked into the handlers, each class has one per
+// register; the other operands are read from the instruction. The table is
+// 512 KiB of pointers on a 64-bit host, so it is shared by every machine
+// and only built once something runs on the table core.
+#define OPCODE_TABLE_SIZE 0x10000
+
+// Returns the table, building it on the first call. Safe from any thread.
+const OpcodeHandler* opcode_table(void);
+// Interpreter core fetching raw instructions and dispatching through the
+// table
+void run_table(struct Chip8* chip8, unsigned long cycles);
+
+#endif
@@ -0,0 +1,127 @@
+#include "profile.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+const uint8_t profile_opcode_class[PROF_OPCODES] = {
+    [PROF_0NNN] = PROF_CLASS_FLOW,    [PROF_00E0] = PROF_CLASS_CLEAR,
+    [PROF_00EE] = PROF_CLASS_FLOW,    [PROF_1NNN] = PROF_CLASS_FLOW,
+    [PROF_2NNN] = PROF_CLASS_FLOW,    [PROF_3XNN] = PROF_CLASS_SKIP,
+    [PROF_4XNN] = PROF_CLASS_SKIP,    [PROF_5XY0] = PROF_CLASS_SKIP,
+    [PROF_6XNN] = PROF_CLASS_ALU,     [PROF_7XNN] = PROF_CLASS_ALU,
+    [PROF_8XY0] = PROF_CLASS_ALU,     [PROF_8XY1] = PROF_CLASS_ALU,
+    [PROF_8XY2] = PROF_CLASS_ALU,     [PROF_8XY3] = PROF_CLASS_ALU,
+    [PROF_8XY4] = PROF_CLASS_ALU,     [PROF_8XY5] = PROF_CLASS_ALU,
+    [PROF_8XY6] = PROF_CLASS_ALU,     [PROF_8XY7] = PROF_CLASS_ALU,
+    [PROF_8XYE] = PROF_CLASS_ALU,     [PROF_9XY0] = PROF_CLASS_SKIP,
+    [PROF_ANNN] = PROF_CLASS_INDEX,   [PROF_BNNN] = PROF_CLASS_FLOW,
+    [PROF_CXNN] = PROF_CLASS_ALU,     [PROF_DXYN] = PROF_CLASS_DRAW,
+    [PROF_EX9E] = PROF_CLASS_SKIP,    [PROF_EXA1] = PROF_CLASS_SKIP,
+    [PROF_FX07] = PROF_CLASS_TIMER,   [PROF_FX0A] = PROF_CLASS_TIMER,
+    [PROF_FX15] = PROF_CLASS_TIMER,   [PROF_FX18] = PROF_CLASS_TIMER,
+    [PROF_FX1E] = PROF_CLASS_INDEX,   [PROF_FX29] = PROF_CLASS_INDEX,
+    [PROF_FX33] = PROF_CLASS_MEMORY,  [PROF_FX55] = PROF_CLASS_MEMORY,
+    [PROF_FX65] = PROF_CLASS_MEMORY,  [PROF_INVALID] = PROF_CLASS_OTHER,
+};
+
+static const char* const opcode_names[PROF_OPCODES] = {
+    "0NNN", "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN",
+    "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+    "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "FX07",
+    "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65", "invalid",
+};
+
+static const char* const class_names[PROF_CLASSES] = {
+    "clear", "draw", "flow", "skip", "alu", "index", "memory", "timer", "other",
+};
+
+static THREAD_LOCAL Profile* attached;
+static volatile sig_atomic_t dump_requested;
+static const char* output_file_name;
+
+static void on_sigprof(int sig) {
+    (void)sig;
+    Profile* profile = attached;
+    if (profile)
+        profile->samples[profile->current]++;
+}
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    dump_requested = TRUE;
+}
+
+void profile_start(const char* file_name) {
+    struct sigaction action;
+    struct itimerval timer;
+
+    output_file_name = file_name;
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = on_sigprof;
+    sigaction(SIGPROF, &action, NULL);
+    action.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &action, NULL);
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_SAMPLE_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void profile_attach(Profile* profile) {
+    attached = profile;
+}
+
+int profile_dump_requested(void) {
+    if (!dump_requested)
+        return FALSE;
+    dump_requested = FALSE;
+    return TRUE;
+}
+
+void profile_dump(FILE* out, const Profile* profile) {
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < PROF_OPCODES; i++) {
+        total += profile->counts[i];
+    }
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"opcodes\": {",
+            (unsigned long long)total);
+    for (unsigned int i = 0; i < PROF_OPCODES; i++) {
+        fprintf(out, "%s\n    \"%s\": %llu", i ? "," : "", opcode_names[i],
+                (unsigned long long)profile->counts[i]);
+    }
+    fprintf(out, "\n  },\n  \"host_time\": {\n    \"sample_us\": %d,\n"
+                 "    \"classes\": {",
+            PROFILE_SAMPLE_US);
+    for (unsigned int i = 0; i < PROF_CLASSES; i++) {
+        fprintf(out, "%s\n      \"%s\": %llu", i ? "," : "", class_names[i],
+                (unsigned long long)profile->samples[i]);
+    }
+    fprintf(out, "%s\n", "\n    }\n  }\n}");
+}
+
+void profile_report(const Profile* profile) {
+    // Each report replaces the previous one in the output file
+    FILE* out = output_file_name ? fopen(output_file_name, "w") : stderr;
+    if (!out) {
+        fprintf(stderr, "Failed to open profile output: %s\n",
+                output_file_name);
+        return;
+    }
+    profile_dump(out, profile);
+    if (out != stderr)
+        fclose(out);
+}
@@ -0,0 +1,166 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Microseconds of process CPU time between host time samples
+#define PROFILE_SAMPLE_US 1000
+
+// The 35 CHIP-8 opcodes, plus anything decode() does not recognise
+typedef enum {
+    PROF_0NNN,
+    PROF_00E0,
+    PROF_00EE,
+    PROF_1NNN,
+    PROF_2NNN,
+    PROF_3XNN,
+    PROF_4XNN,
+    PROF_5XY0,
+    PROF_6XNN,
+    PROF_7XNN,
+    PROF_8XY0,
+    PROF_8XY1,
+    PROF_8XY2,
+    PROF_8XY3,
+    PROF_8XY4,
+    PROF_8XY5,
+    PROF_8XY6,
+    PROF_8XY7,
+    PROF_8XYE,
+    PROF_9XY0,
+    PROF_ANNN,
+    PROF_BNNN,
+    PROF_CXNN,
+    PROF_DXYN,
+    PROF_EX9E,
+    PROF_EXA1,
+    PROF_FX07,
+    PROF_FX0A,
+    PROF_FX15,
+    PROF_FX18,
+    PROF_FX1E,
+    PROF_FX29,
+    PROF_FX33,
+    PROF_FX55,
+    PROF_FX65,
+    PROF_INVALID,
+    PROF_OPCODES,
+} ProfileOpcode;
+
+// Groups host time is sampled by. Drawing and clearing get their own since
+// they cost far more per instruction than the rest.
+typedef enum {
+    PROF_CLASS_CLEAR,
+    PROF_CLASS_DRAW,
+    PROF_CLASS_FLOW,
+    PROF_CLASS_SKIP,
+    PROF_CLASS_ALU,
+    PROF_CLASS_INDEX,
+    PROF_CLASS_MEMORY,
+    PROF_CLASS_TIMER,
+    PROF_CLASS_OTHER,
+    PROF_CLASSES,
+} ProfileClass;
+
+typedef struct {
+    uint64_t counts[PROF_OPCODES];
+    uint64_t samples[PROF_CLASSES];
+    // Class of the instruction executing now, read by the sampling timer
+    volatile uint8_t current;
+} Profile;
+
+extern const uint8_t profile_opcode_class[PROF_OPCODES];
+
+static inline ProfileOpcode profile_opcode(uint16_t instruction) {
+    switch (instruction >> 12) {
+        case 0x0:
+            if (instruction == 0x00E0)
+                return PROF_00E0;
+            return instruction == 0x00EE ? PROF_00EE : PROF_0NNN;
+        case 0x8:
+            if ((instruction & 0xF) <= 0x7)
+                return PROF_8XY0 + (instruction & 0xF);
+            return (instruction & 0xF) == 0xE ? PROF_8XYE : PROF_INVALID;
+        case 0xE:
+            if ((instruction & 0xFF) == 0x9E)
+                return PROF_EX9E;
+            return (instruction & 0xFF) == 0xA1 ? PROF_EXA1 : PROF_INVALID;
+        case 0xF:
+            switch (instruction & 0xFF) {
+                case 0x07:
+                    return PROF_FX07;
+                case 0x0A:
+                    return PROF_FX0A;
+                case 0x15:
+                    return PROF_FX15;
+                case 0x18:
+                    return PROF_FX18;
+                case 0x1E:
+                    return PROF_FX1E;
+                case 0x29:
+                    return PROF_FX29;
+                case 0x33:
+                    return PROF_FX33;
+                case 0x55:
+                    return PROF_FX55;
+                case 0x65:
+                    return PROF_FX65;
+                default:
+                    return PROF_INVALID;
+            }
+        default: {
+            // 1NNN to DXYN are one opcode per leading nibble, with the 8XYN
+            // group sitting between 7XNN and 9XY0
+            static const uint8_t by_nibble[16] = {
+                [0x1] = PROF_1NNN, [0x2] = PROF_2NNN, [0x3] = PROF_3XNN,
+                [0x4] = PROF_4XNN, [0x5] = PROF_5XY0, [0x6] = PROF_6XNN,
+                [0x7] = PROF_7XNN, [0x9] = PROF_9XY0, [0xA] = PROF_ANNN,
+                [0xB] = PROF_BNNN, [0xC] = PROF_CXNN, [0xD] = PROF_DXYN,
+            };
+            return by_nibble[instruction >> 12];
+        }
+    }
+}
+
+static inline void profile_instruction(Profile* profile,
+                                       uint16_t instruction) {
+    ProfileOpcode opcode = profile_opcode(instruction);
+    profile->counts[opcode]++;
+    profile->current = profile_opcode_class[opcode];
+}
+
+// Installs the SIGPROF sampling timer and the SIGUSR1 dump request handler.
+// Profiles are written to file_name, or stderr if it is NULL.
+void profile_start(const char* file_name);
+// Host time samples on this thread go to profile until the next call; NULL
+// stops attributing them
+void profile_attach(Profile* profile);
+// Returns TRUE once for every SIGUSR1 received
+int profile_dump_requested(void);
+void profile_dump(FILE* out, const Profile* profile);
+void profile_report(const Profile* profile);
+
+// Hooks for the interpreter loops, compiled to nothing without CHIP8_PROFILE
+#ifdef CHIP8_PROFILE
+#define PROFILE_INSTRUCTION(chip8, addr)                                  \
+    profile_instruction(&(chip8)->profile,                                \
+                        (addr) < RAM_SIZE - 1                             \
+                            ? (uint16_t)((chip8)->mem[(addr)] << 8 |      \
+                                         (chip8)->mem[(addr) + 1])        \
+                            : 0xFFFF)
+#define PROFILE_ATTACH(chip8) profile_attach(&(chip8)->profile)
+#define PROFILE_DETACH() profile_attach(NULL)
+#define PROFILE_POLL(chip8)                    \
+    do {                                       \
+        if (profile_dump_requested())          \
+            profile_report(&(chip8)->profile); \
+    } while (0)
+#else
+#define PROFILE_INSTRUCTION(chip8, addr) ((void)0)
+#define PROFILE_ATTACH(chip8) ((void)0)
+#define PROFILE_DETACH() ((void)0)
+#define PROFILE_POLL(chip8) ((void)0)
+#endif
+
+#endif
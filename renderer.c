@@ -0,0 +1,147 @@
+#include "renderer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// The frame starts with a border line and each row has a "%2d|" label, so
+// pixel (x, y) sits at terminal row y + 2, column x + 4 (both 1-based)
+#define ROW_OFFSET 2
+#define COL_OFFSET 4
+
+void renderer_init(Renderer* renderer, int fd, int full_redraw) {
+    renderer->fd = fd;
+    renderer->full_redraw = full_redraw;
+    renderer->first_frame = TRUE;
+    renderer->length = 0;
+}
+
+void display(Chip8* chip8) {
+    system("clear");
+    printf("%s", "  +");
+    for (int i = 0; i < DISPLAY_X; i++)
+        putchar('-');
+    printf("%s\n", "+");
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        printf("%2d|", row);
+        for (unsigned int col = 0; col < DISPLAY_X; col++) {
+            putchar(get_pixel(chip8, col, row) ? '#' : ' ');
+        }
+
+        printf("%s\n", "|");
+    }
+
+    printf("%s", "  +");
+    for (int i = 0; i < DISPLAY_X; i++)
+        putchar('-');
+    printf("%s\n", "+");
+}
+
+static void append(Renderer* renderer, const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        renderer->buffer[renderer->length++] = text[i];
+    }
+}
+
+static void append_str(Renderer* renderer, const char* text) {
+    while (*text) {
+        renderer->buffer[renderer->length++] = *text++;
+    }
+}
+
+static void move_cursor(Renderer* renderer,
+                        unsigned int row,
+                        unsigned int col) {
+    renderer->length += snprintf(renderer->buffer + renderer->length,
+                                 RENDER_BUFFER_SIZE - renderer->length,
+                                 "\x1b[%u;%uH", row, col);
+}
+
+static void append_border(Renderer* renderer) {
+    append_str(renderer, "  +");
+    for (int i = 0; i < DISPLAY_X; i++)
+        append(renderer, "-", 1);
+    append_str(renderer, "+\n");
+}
+
+static void append_full_frame(Renderer* renderer, Chip8* chip8) {
+    // Clear screen and home the cursor
+    append_str(renderer, "\x1b[H\x1b[2J");
+    append_border(renderer);
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        renderer->length += snprintf(renderer->buffer + renderer->length,
+                                     RENDER_BUFFER_SIZE - renderer->length,
+                                     "%2u|", row);
+        for (unsigned int col = 0; col < DISPLAY_X; col++) {
+            append(renderer, get_pixel(chip8, col, row) ? "#" : " ", 1);
+        }
+        append_str(renderer, "|\n");
+    }
+    append_border(renderer);
+}
+
+static void append_changed_cells(Renderer* renderer, Chip8* chip8) {
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        uint64_t changed = chip8->display_buffer[row] ^ renderer->shown[row];
+        unsigned int col = 0;
+
+        while (changed) {
+            // Skip to the next changed column, then emit the whole run of
+            // changed cells after a single cursor move
+            while (!((changed >> (DISPLAY_X - 1 - col)) & 1))
+                col++;
+            move_cursor(renderer, row + ROW_OFFSET, col + COL_OFFSET);
+            while (col < DISPLAY_X &&
+                   ((changed >> (DISPLAY_X - 1 - col)) & 1)) {
+                append(renderer, get_pixel(chip8, col, row) ? "#" : " ", 1);
+                changed &= ~(1ULL << (DISPLAY_X - 1 - col));
+                col++;
+            }
+        }
+    }
+}
+
+static void flush(Renderer* renderer) {
+    size_t written = 0;
+    while (written < renderer->length) {
+        ssize_t result = write(renderer->fd, renderer->buffer + written,
+                               renderer->length - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += result;
+    }
+}
+
+// Draws whatever changed since the last call and returns the number of bytes
+// sent to the terminal; an unchanged screen sends nothing
+size_t render_frame(Renderer* renderer, Chip8* chip8) {
+    renderer->length = 0;
+
+    if (renderer->full_redraw) {
+        display(chip8);
+        return 0;
+    }
+
+    if (renderer->first_frame) {
+        append_full_frame(renderer, chip8);
+        renderer->first_frame = FALSE;
+    } else {
+        append_changed_cells(renderer, chip8);
+        if (renderer->length == 0)
+            return 0;
+        // Park the cursor under the frame
+        move_cursor(renderer, DISPLAY_Y + ROW_OFFSET + 1, 1);
+    }
+
+    for (unsigned int row = 0; row < DISPLAY_Y; row++) {
+        renderer->shown[row] = chip8->display_buffer[row];
+    }
+    flush(renderer);
+    return renderer->length;
+}
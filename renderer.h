@@ -0,0 +1,29 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8machine.h"
+
+// Worst case for one frame: every other cell changed, each needing its own
+// cursor move, plus a full redraw's worth of border and labels
+#define RENDER_BUFFER_SIZE (DISPLAY_X * DISPLAY_Y * 12 + 4096)
+
+// Terminal renderer that only redraws cells that changed since the last
+// presented frame, using ANSI cursor moves and a single write() per frame
+typedef struct {
+    int fd;
+    // Clear and redraw everything through display() instead
+    int full_redraw;
+    // Nothing presented yet, the next frame is drawn in full
+    int first_frame;
+    uint64_t shown[DISPLAY_Y];
+    size_t length;
+    char buffer[RENDER_BUFFER_SIZE];
+} Renderer;
+
+void renderer_init(Renderer* renderer, int fd, int full_redraw);
+size_t render_frame(Renderer* renderer, Chip8* chip8);
+void display(Chip8* chip8);
+
+#endif
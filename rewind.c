@@ -0,0 +1,248 @@
+#include "rewind.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+// Worst case for a record: alternating zero and changed bytes, each needing
+// two one-byte lengths, plus the final run
+#define MAX_RECORD_SIZE (sizeof(Chip8Snapshot) * 2 + 16)
+
+static uint8_t* put_length(uint8_t* out, size_t length) {
+    // 7 bits per byte, high bit set while more follow
+    while (length >= 0x80) {
+        *out++ = (uint8_t)(length | 0x80);
+        length >>= 7;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+static const uint8_t* get_length(const uint8_t* in, size_t* length) {
+    unsigned int shift = 0;
+    *length = 0;
+    do {
+        *length |= (size_t)(*in & 0x7F) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+    return in;
+}
+
+static size_t encode_delta(const uint8_t* from,
+                           const uint8_t* to,
+                           size_t size,
+                           uint8_t* out) {
+    // Alternating runs of unchanged bytes and XORed literals. A literal only
+    // ends at two unchanged bytes in a row, which keeps scattered single
+    // byte changes from costing two lengths each.
+    uint8_t* start = out;
+    size_t i = 0;
+
+    while (i < size) {
+        size_t zeros = i;
+        while (i < size && from[i] == to[i])
+            i++;
+        zeros = i - zeros;
+
+        size_t literal = i;
+        while (i < size &&
+               (from[i] != to[i] || (i + 1 < size && from[i + 1] != to[i + 1])))
+            i++;
+        literal = i - literal;
+
+        out = put_length(out, zeros);
+        out = put_length(out, literal);
+        for (size_t j = i - literal; j < i; j++) {
+            *out++ = from[j] ^ to[j];
+        }
+    }
+    return out - start;
+}
+
+static void apply_delta(uint8_t* state, const uint8_t* in, size_t length) {
+    const uint8_t* end = in + length;
+    size_t zeros;
+    size_t literal;
+
+    while (in < end) {
+        in = get_length(in, &zeros);
+        in = get_length(in, &literal);
+        state += zeros;
+        for (size_t j = 0; j < literal; j++) {
+            *state++ ^= *in++;
+        }
+    }
+}
+
+static RewindFrame* frame_at(const Rewind* rewind, unsigned long frame) {
+    return &rewind->frames[frame % rewind->max_frames];
+}
+
+static void ring_write(Rewind* rewind, const uint8_t* bytes, size_t length) {
+    size_t first = rewind->capacity - rewind->head;
+    if (first > length)
+        first = length;
+    memcpy(rewind->data + rewind->head, bytes, first);
+    memcpy(rewind->data, bytes + first, length - first);
+    rewind->head = (rewind->head + length) % rewind->capacity;
+    rewind->used += length;
+}
+
+static const uint8_t* ring_read(Rewind* rewind, const RewindFrame* frame) {
+    // Records that wrap around the end are copied out in one piece
+    size_t first = rewind->capacity - frame->offset;
+    if (first >= frame->length)
+        return rewind->data + frame->offset;
+    memcpy(rewind->record, rewind->data + frame->offset, first);
+    memcpy(rewind->record + first, rewind->data, frame->length - first);
+    return rewind->record;
+}
+
+static void drop_oldest_group(Rewind* rewind) {
+    // Deltas are useless without the keyframe they start from, so drop up
+    // to the next keyframe
+    do {
+        RewindFrame* frame = frame_at(rewind, rewind->oldest);
+        rewind->tail = (rewind->tail + frame->length) % rewind->capacity;
+        rewind->used -= frame->length;
+        rewind->oldest++;
+        rewind->count--;
+    } while (rewind->count > 0 && !frame_at(rewind, rewind->oldest)->keyframe);
+}
+
+static void drop_after_cursor(Rewind* rewind) {
+    // Frames after the cursor belong to the timeline a seek went back from
+    unsigned long newest = rewind_newest(rewind);
+    if (rewind->count == 0 || rewind->cursor == newest)
+        return;
+
+    for (unsigned long frame = rewind->cursor + 1; frame <= newest; frame++) {
+        rewind->used -= frame_at(rewind, frame)->length;
+    }
+    rewind->head = frame_at(rewind, rewind->cursor + 1)->offset;
+    rewind->count = rewind->cursor - rewind->oldest + 1;
+}
+
+static int needs_keyframe(const Rewind* rewind) {
+    if (rewind->count == 0)
+        return TRUE;
+    // The oldest frame is always a keyframe, so this stops there at the latest
+    unsigned long frame = rewind->cursor;
+    for (unsigned int i = 1; i < REWIND_KEYFRAME_INTERVAL; i++) {
+        if (frame_at(rewind, frame)->keyframe)
+            return FALSE;
+        frame--;
+    }
+    return TRUE;
+}
+
+void rewind_init(Rewind* rewind, size_t size, unsigned long max_frames) {
+    rewind->data = malloc(size);
+    rewind->frames = calloc(max_frames, sizeof(RewindFrame));
+    rewind->record = malloc(MAX_RECORD_SIZE);
+    if (!rewind->data || !rewind->frames || !rewind->record) {
+        printf("%s\n", "Failed to allocate memory for rewind. Exiting.");
+        exit(-1);
+    }
+    rewind->capacity = size;
+    rewind->max_frames = max_frames;
+    rewind->head = 0;
+    rewind->tail = 0;
+    rewind->used = 0;
+    rewind->oldest = 0;
+    rewind->count = 0;
+    rewind->cursor = 0;
+    // Padding in the snapshots is never written, keep it out of the deltas
+    memset(&rewind->last, 0, sizeof(rewind->last));
+    memset(&rewind->current, 0, sizeof(rewind->current));
+}
+
+void rewind_free(Rewind* rewind) {
+    free(rewind->data);
+    free(rewind->frames);
+    free(rewind->record);
+    rewind->data = NULL;
+    rewind->frames = NULL;
+    rewind->record = NULL;
+}
+
+void rewind_record(Rewind* rewind, Chip8* chip8) {
+    static const Chip8Snapshot zero;
+
+    drop_after_cursor(rewind);
+    save_snapshot(chip8, &rewind->current);
+
+    int keyframe = needs_keyframe(rewind);
+    const Chip8Snapshot* base = keyframe ? &zero : &rewind->last;
+    size_t length =
+        encode_delta((const uint8_t*)base, (const uint8_t*)&rewind->current,
+                     sizeof(Chip8Snapshot), rewind->record);
+
+    while (rewind->count > 0 && (rewind->count == rewind->max_frames ||
+                                 rewind->used + length > rewind->capacity)) {
+        drop_oldest_group(rewind);
+    }
+    if (rewind->count == 0 && !keyframe) {
+        // The whole history went to make room, start over from this frame
+        keyframe = TRUE;
+        length = encode_delta((const uint8_t*)&zero,
+                              (const uint8_t*)&rewind->current,
+                              sizeof(Chip8Snapshot), rewind->record);
+    }
+    if (length > rewind->capacity) {
+        printf("%s\n", "Rewind buffer too small for one frame. Exiting.");
+        exit(-1);
+    }
+
+    unsigned long frame = rewind->oldest + rewind->count;
+    if (rewind->count == 0) {
+        rewind->head = 0;
+        rewind->tail = 0;
+    }
+    RewindFrame* slot = frame_at(rewind, frame);
+    slot->offset = rewind->head;
+    slot->length = length;
+    slot->keyframe = keyframe;
+    ring_write(rewind, rewind->record, length);
+
+    rewind->count++;
+    rewind->cursor = frame;
+    rewind->last = rewind->current;
+}
+
+int rewind_seek(Rewind* rewind, Chip8* chip8, unsigned long frame) {
+    if (rewind->count == 0 || frame < rewind->oldest ||
+        frame > rewind_newest(rewind))
+        return FALSE;
+
+    unsigned long keyframe = frame;
+    while (!frame_at(rewind, keyframe)->keyframe)
+        keyframe--;
+
+    unsigned long replay;
+    if (rewind->cursor <= frame && rewind->cursor >= keyframe) {
+        // Stepping forward within a group continues from the cursor
+        replay = rewind->cursor + 1;
+    } else {
+        memset(&rewind->last, 0, sizeof(rewind->last));
+        replay = keyframe;
+    }
+    for (; replay <= frame; replay++) {
+        const RewindFrame* record = frame_at(rewind, replay);
+        apply_delta((uint8_t*)&rewind->last, ring_read(rewind, record),
+                    record->length);
+    }
+
+    rewind->cursor = frame;
+    return restore_snapshot(chip8, &rewind->last);
+}
+
+unsigned long rewind_oldest(const Rewind* rewind) {
+    return rewind->oldest;
+}
+
+unsigned long rewind_newest(const Rewind* rewind) {
+    return rewind->oldest + rewind->count - 1;
+}
@@ -0,0 +1,58 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8machine.h"
+#include "snapshot.h"
+
+// Frames between two frames stored in full, bounding how many deltas a seek
+// has to replay
+#define REWIND_KEYFRAME_INTERVAL 60
+#define REWIND_DEFAULT_SIZE (4 * 1024 * 1024)
+// Frame slots for a buffer of that size; idle frames compress to a few bytes
+#define REWIND_DEFAULT_FRAMES (60 * 60 * 10)
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    int keyframe;
+} RewindFrame;
+
+// History of machine states, one per recorded frame. Every frame is stored
+// as the XOR of its snapshot with the previous frame's, run-length encoded,
+// with a keyframe against an all-zero snapshot every REWIND_KEYFRAME_INTERVAL
+// frames. Oldest frames are dropped a keyframe group at a time once the byte
+// ring or the frame slots run out.
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    // Byte ring: records live in [tail, head), wrapping at capacity
+    size_t head;
+    size_t tail;
+    size_t used;
+    RewindFrame* frames;
+    unsigned long max_frames;
+    // Frame numbers count up from the first recorded frame
+    unsigned long oldest;
+    unsigned long count;
+    // Frame the machine was last recorded at or rewound to
+    unsigned long cursor;
+    // Snapshot of the cursor frame, the base for the next delta
+    Chip8Snapshot last;
+    Chip8Snapshot current;
+    uint8_t* record;
+} Rewind;
+
+void rewind_init(Rewind* rewind, size_t size, unsigned long max_frames);
+void rewind_free(Rewind* rewind);
+// Appends the machine's state as the frame after the cursor, dropping any
+// frames after the cursor left over from an earlier seek
+void rewind_record(Rewind* rewind, Chip8* chip8);
+// Restores the machine to a recorded frame. Returns FALSE if the frame is no
+// longer, or not yet, in the history.
+int rewind_seek(Rewind* rewind, Chip8* chip8, unsigned long frame);
+unsigned long rewind_oldest(const Rewind* rewind);
+unsigned long rewind_newest(const Rewind* rewind);
+
+#endif
@@ -0,0 +1,156 @@
+#include "romcache.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define ROM_CACHE_INITIAL_CAPACITY 16
+
+static Chip8Status map_rom(const char* path, CachedRom* rom) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CHIP8_ERROR_IO;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return CHIP8_ERROR_IO;
+    }
+    if (st.st_size > ROM_MAX_SIZE) {
+        close(fd);
+        return CHIP8_ERROR_ROM_TOO_LARGE;
+    }
+
+    rom->size = st.st_size;
+    rom->data = NULL;
+    if (rom->size > 0) {
+        void* mapping = mmap(NULL, rom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return CHIP8_ERROR_IO;
+        }
+        rom->data = mapping;
+    }
+    close(fd);
+    rom->hash = hash_bytes(0xCBF29CE484222325ULL, rom->data, rom->size);
+    return CHIP8_OK;
+}
+
+static void unmap_rom(CachedRom* rom) {
+    if (rom->size > 0)
+        munmap((void*)rom->data, rom->size);
+}
+
+static CachedRom* find_contents(RomCache* cache, const CachedRom* rom) {
+    for (unsigned int i = 0; i < cache->num_entries; i++) {
+        CachedRom* other = cache->entries[i].rom;
+        if (other->hash != rom->hash || other->size != rom->size)
+            continue;
+        if (rom->size == 0 || memcmp(other->data, rom->data, rom->size) == 0)
+            return other;
+    }
+    return NULL;
+}
+
+static Chip8Status add_entry(RomCache* cache,
+                             const char* path,
+                             CachedRom* rom) {
+    if (cache->num_entries == cache->capacity) {
+        unsigned int capacity = cache->capacity
+                                    ? cache->capacity * 2
+                                    : ROM_CACHE_INITIAL_CAPACITY;
+        RomCacheEntry* entries =
+            realloc(cache->entries, capacity * sizeof(RomCacheEntry));
+        if (!entries)
+            return CHIP8_ERROR_NO_MEMORY;
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (!copy)
+        return CHIP8_ERROR_NO_MEMORY;
+    cache->entries[cache->num_entries].path = copy;
+    cache->entries[cache->num_entries].rom = rom;
+    cache->num_entries++;
+    return CHIP8_OK;
+}
+
+void rom_cache_init(RomCache* cache) {
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->entries = NULL;
+    cache->num_entries = 0;
+    cache->capacity = 0;
+}
+
+void rom_cache_free(RomCache* cache) {
+    // Entries sharing contents share one CachedRom; free it with the first
+    for (unsigned int i = 0; i < cache->num_entries; i++) {
+        CachedRom* rom = cache->entries[i].rom;
+        int first = TRUE;
+        for (unsigned int j = 0; j < i && first; j++) {
+            if (cache->entries[j].rom == rom)
+                first = FALSE;
+        }
+        if (first) {
+            unmap_rom(rom);
+            free(rom);
+        }
+    }
+    for (unsigned int i = 0; i < cache->num_entries; i++) {
+        free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+Chip8Status rom_cache_get(RomCache* cache,
+                          const char* path,
+                          const CachedRom** rom) {
+    Chip8Status status = CHIP8_OK;
+
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned int i = 0; i < cache->num_entries; i++) {
+        if (strcmp(cache->entries[i].path, path) == 0) {
+            *rom = cache->entries[i].rom;
+            pthread_mutex_unlock(&cache->lock);
+            return CHIP8_OK;
+        }
+    }
+
+    CachedRom* mapped = malloc(sizeof(CachedRom));
+    if (!mapped) {
+        status = CHIP8_ERROR_NO_MEMORY;
+    } else {
+        status = map_rom(path, mapped);
+    }
+    if (status == CHIP8_OK) {
+        // Another path to the same bytes: keep the mapping already shared
+        CachedRom* same = find_contents(cache, mapped);
+        if (same) {
+            unmap_rom(mapped);
+            free(mapped);
+            mapped = same;
+        }
+        status = add_entry(cache, path, mapped);
+        if (status != CHIP8_OK && !same) {
+            unmap_rom(mapped);
+            free(mapped);
+        }
+    } else {
+        free(mapped);
+    }
+    if (status == CHIP8_OK)
+        *rom = mapped;
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+void load_cached_rom(Chip8* chip8, const CachedRom* rom) {
+    // Always fits: the cache rejects anything larger up front
+    load_rom_buffer(chip8, rom->data, rom->size, 0x200);
+}
@@ -0,0 +1,45 @@
+#ifndef ROMCACHE_H
+#define ROMCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8machine.h"
+
+// Largest ROM that fits between the program start and the end of RAM
+#define ROM_MAX_SIZE (RAM_SIZE - 0x200)
+
+// A ROM image mapped read-only, shared by every machine loaded from it
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    uint64_t hash;
+} CachedRom;
+
+typedef struct {
+    char* path;
+    CachedRom* rom;
+} RomCacheEntry;
+
+// Maps each ROM file once and hands the mapping to any number of machines
+// on any thread. Files with the same contents share one mapping. Mappings
+// stay valid until the cache is freed.
+typedef struct {
+    pthread_mutex_t lock;
+    RomCacheEntry* entries;
+    unsigned int num_entries;
+    unsigned int capacity;
+} RomCache;
+
+void rom_cache_init(RomCache* cache);
+void rom_cache_free(RomCache* cache);
+// Finds or maps the ROM at path. Fails with CHIP8_ERROR_IO if it cannot be
+// mapped and CHIP8_ERROR_ROM_TOO_LARGE if it would not fit in RAM.
+Chip8Status rom_cache_get(RomCache* cache,
+                          const char* path,
+                          const CachedRom** rom);
+
+// Copies a cached ROM into a machine at 0x200
+void load_cached_rom(Chip8* chip8, const CachedRom* rom);
+
+#endif
@@ -0,0 +1,222 @@
+#include "sampler.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define INITIAL_CAPACITY 256
+#define MAX_NAME_LENGTH 64
+
+static void* allocate(size_t size) {
+    void* memory = calloc(1, size);
+    if (!memory) {
+        printf("%s\n", "Failed to allocate memory for sampler. Exiting.");
+        exit(-1);
+    }
+    return memory;
+}
+
+static uint64_t hash_stack(uint16_t pc,
+                           uint16_t depth,
+                           const uint16_t* frames) {
+    uint64_t hash = hash_bytes(0xCBF29CE484222325ULL,
+                               (const unsigned char*)&pc, sizeof(pc));
+    return hash_bytes(hash, (const unsigned char*)frames,
+                      depth * sizeof(uint16_t));
+}
+
+static StackSample* find_slot(StackSample* samples,
+                              unsigned int capacity,
+                              uint16_t pc,
+                              uint16_t depth,
+                              const uint16_t* frames) {
+    unsigned int i = hash_stack(pc, depth, frames) & (capacity - 1);
+    for (;;) {
+        StackSample* sample = &samples[i];
+        if (sample->count == 0 ||
+            (sample->pc == pc && sample->depth == depth &&
+             memcmp(sample->frames, frames, depth * sizeof(uint16_t)) == 0))
+            return sample;
+        i = (i + 1) & (capacity - 1);
+    }
+}
+
+static void grow(GuestSampler* sampler) {
+    unsigned int capacity = sampler->capacity * 2;
+    StackSample* samples = allocate(capacity * sizeof(StackSample));
+
+    for (unsigned int i = 0; i < sampler->capacity; i++) {
+        const StackSample* old = &sampler->samples[i];
+        if (old->count)
+            *find_slot(samples, capacity, old->pc, old->depth, old->frames) =
+                *old;
+    }
+    free(sampler->samples);
+    sampler->samples = samples;
+    sampler->capacity = capacity;
+}
+
+void sampler_init(GuestSampler* sampler, unsigned long interval) {
+    sampler->interval = interval;
+    sampler->until_sample = interval;
+    sampler->capacity = INITIAL_CAPACITY;
+    sampler->used = 0;
+    sampler->samples = allocate(INITIAL_CAPACITY * sizeof(StackSample));
+    sampler->symbols = NULL;
+    sampler->num_symbols = 0;
+}
+
+void sampler_free(GuestSampler* sampler) {
+    for (unsigned int i = 0; i < sampler->num_symbols; i++) {
+        free(sampler->symbols[i].name);
+    }
+    free(sampler->symbols);
+    free(sampler->samples);
+    sampler->symbols = NULL;
+    sampler->samples = NULL;
+}
+
+static int compare_symbols(const void* a, const void* b) {
+    return (int)((const GuestSymbol*)a)->addr -
+           (int)((const GuestSymbol*)b)->addr;
+}
+
+int sampler_load_symbols(GuestSampler* sampler, const char* file_name) {
+    FILE* f = fopen(file_name, "r");
+    if (!f)
+        return FALSE;
+
+    char line[256];
+    unsigned int capacity = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int addr;
+        char name[MAX_NAME_LENGTH];
+        if (line[0] == '#' || sscanf(line, "%x %63s", &addr, name) != 2)
+            continue;
+        if (sampler->num_symbols == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            GuestSymbol* symbols =
+                realloc(sampler->symbols, capacity * sizeof(GuestSymbol));
+            if (!symbols) {
+                printf("%s\n",
+                       "Failed to allocate memory for symbols. Exiting.");
+                exit(-1);
+            }
+            sampler->symbols = symbols;
+        }
+        sampler->symbols[sampler->num_symbols].addr = addr & 0xFFF;
+        sampler->symbols[sampler->num_symbols].name = strdup(name);
+        sampler->num_symbols++;
+    }
+    fclose(f);
+
+    qsort(sampler->symbols, sampler->num_symbols, sizeof(GuestSymbol),
+          compare_symbols);
+    return TRUE;
+}
+
+static const GuestSymbol* lookup(const GuestSampler* sampler, uint16_t addr) {
+    // Last symbol at or below addr
+    const GuestSymbol* found = NULL;
+    unsigned int low = 0;
+    unsigned int high = sampler->num_symbols;
+    while (low < high) {
+        unsigned int mid = (low + high) / 2;
+        if (sampler->symbols[mid].addr <= addr) {
+            found = &sampler->symbols[mid];
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return found;
+}
+
+void sampler_record(GuestSampler* sampler, const Chip8* chip8) {
+    const Stack* stack = &chip8->stack;
+    uint16_t pc = chip8->pc;
+    uint16_t depth = stack->top;
+
+    if ((sampler->used + 1) * 4 > sampler->capacity * 3)
+        grow(sampler);
+    StackSample* sample =
+        find_slot(sampler->samples, sampler->capacity, pc, depth, stack->data);
+    if (sample->count == 0) {
+        sample->pc = pc;
+        sample->depth = depth;
+        memcpy(sample->frames, stack->data, depth * sizeof(uint16_t));
+        sampler->used++;
+    }
+    sample->count++;
+}
+
+void sampler_run(GuestSampler* sampler,
+                 Chip8* chip8,
+                 Chip8Core core,
+                 unsigned long cycles) {
+    while (cycles > 0) {
+        unsigned long slice = cycles < sampler->until_sample
+                                  ? cycles
+                                  : sampler->until_sample;
+        run_tick(chip8, core, slice);
+        cycles -= slice;
+        sampler->until_sample -= slice;
+        if (sampler->until_sample == 0) {
+            sampler_record(sampler, chip8);
+            sampler->until_sample = sampler->interval;
+        }
+    }
+}
+
+static void write_function(const GuestSampler* sampler,
+                           uint16_t entry,
+                           FILE* out) {
+    const GuestSymbol* symbol = lookup(sampler, entry);
+    if (symbol && symbol->addr == entry) {
+        fprintf(out, "%s", symbol->name);
+    } else {
+        fprintf(out, "sub_%03x", entry);
+    }
+}
+
+static void write_location(const GuestSampler* sampler,
+                           uint16_t addr,
+                           FILE* out) {
+    const GuestSymbol* symbol = lookup(sampler, addr);
+    if (symbol) {
+        fprintf(out, "%s+0x%x", symbol->name, addr - symbol->addr);
+    } else {
+        fprintf(out, "0x%03x", addr);
+    }
+}
+
+void sampler_write_collapsed(const GuestSampler* sampler,
+                             const Chip8* chip8,
+                             FILE* out) {
+    // Frames are named after the function each return address returns into
+    // from, read off the 2NNN just before it; the leaf is the sampled pc
+    for (unsigned int i = 0; i < sampler->capacity; i++) {
+        const StackSample* sample = &sampler->samples[i];
+        if (sample->count == 0)
+            continue;
+
+        write_function(sampler, 0x200, out);
+        for (unsigned int frame = 0; frame < sample->depth; frame++) {
+            uint16_t call = sample->frames[frame] - 2;
+            uint16_t instruction = call < RAM_SIZE - 1
+                                       ? chip8->mem[call] << 8 |
+                                             chip8->mem[call + 1]
+                                       : 0;
+            fputc(';', out);
+            if ((instruction >> 12) == 0x2) {
+                write_function(sampler, instruction & 0x0FFF, out);
+            } else {
+                write_location(sampler, call, out);
+            }
+        }
+        fputc(';', out);
+        write_location(sampler, sample->pc, out);
+        fprintf(out, " %llu\n", (unsigned long long)sample->count);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "chip8machine.h"
+
+#define SAMPLER_DEFAULT_INTERVAL 1000
+
+typedef struct {
+    uint16_t addr;
+    char* name;
+} GuestSymbol;
+
+// One distinct guest call stack and how often it was seen
+typedef struct {
+    uint64_t count;
+    uint16_t pc;
+    uint16_t depth;
+    uint16_t frames[STACK_SIZE];
+} StackSample;
+
+// Guest profiler: runs a machine in slices of interval cycles and records
+// pc and the return addresses on its stack after each slice, so the
+// interpreter loops themselves pay nothing for it
+typedef struct {
+    unsigned long interval;
+    // Cycles left until the next sample, carried across sampler_run calls
+    unsigned long until_sample;
+    StackSample* samples;
+    // Open addressed on a hash of the stack, capacity is a power of two
+    unsigned int capacity;
+    unsigned int used;
+    GuestSymbol* symbols;
+    unsigned int num_symbols;
+} GuestSampler;
+
+void sampler_init(GuestSampler* sampler, unsigned long interval);
+void sampler_free(GuestSampler* sampler);
+// Reads "address name" lines, address in hex; # starts a comment. Returns
+// FALSE if the file cannot be opened.
+int sampler_load_symbols(GuestSampler* sampler, const char* file_name);
+void sampler_run(GuestSampler* sampler,
+                 Chip8* chip8,
+                 Chip8Core core,
+                 unsigned long cycles);
+void sampler_record(GuestSampler* sampler, const Chip8* chip8);
+// One line per stack, frames root first and separated by semicolons,
+// followed by its sample count, as flamegraph.pl and speedscope read it.
+// Callers are named from the machine's memory as it is when written.
+void sampler_write_collapsed(const GuestSampler* sampler,
+                             const Chip8* chip8,
+                             FILE* out);
+
+#endif
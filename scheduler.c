@@ -0,0 +1,104 @@
+#include "scheduler.h"
+#include <errno.h>
+#include "inputlog.h"
+#include <stdio.h>
+#include <time.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+#define NSEC_PER_SEC 1000000000L
+// Give up on catching up once this many ticks behind
+#define MAX_TICKS_BEHIND 5
+
+static void tick_deadline(const struct timespec* start,
+                          unsigned long tick,
+                          struct timespec* deadline) {
+    // Computed from the start time so rounding does not accumulate
+    long long nsec = (long long)tick * NSEC_PER_SEC / TIMER_HZ;
+    deadline->tv_sec = start->tv_sec + nsec / NSEC_PER_SEC;
+    deadline->tv_nsec = start->tv_nsec + nsec % NSEC_PER_SEC;
+    if (deadline->tv_nsec >= NSEC_PER_SEC) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= NSEC_PER_SEC;
+    }
+}
+
+static int is_behind(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long late = (long long)(now.tv_sec - deadline->tv_sec) * NSEC_PER_SEC +
+                     (now.tv_nsec - deadline->tv_nsec);
+    return late > (long long)MAX_TICKS_BEHIND * NSEC_PER_SEC / TIMER_HZ;
+}
+
+void run_scheduler(Chip8* chip8,
+                   Chip8Core core,
+                   unsigned long ips,
+                   Renderer* renderer,
+                   Rewind* rewind,
+                   GuestSampler* sampler) {
+    struct timespec start, deadline;
+    unsigned long tick = 0;
+    unsigned long executed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!detect_stuck(chip8) && chip8->fault == FAULT_NONE) {
+        // Spread ips over the ticks of a second without losing the remainder
+        unsigned long target = (unsigned long)((unsigned long long)(tick + 1) *
+                                               ips / TIMER_HZ);
+        unsigned long cycles = target - executed;
+        if (chip8->input_log)
+            input_log_frame(chip8->input_log, chip8, &cycles);
+        if (sampler) {
+            sampler_run(sampler, chip8, core, cycles);
+        } else {
+            run_tick(chip8, core, cycles);
+        }
+        executed = target;
+
+        tick_timers(chip8);
+        render_frame(renderer, chip8);
+        PROFILE_POLL(chip8);
+        if (rewind)
+            rewind_record(rewind, chip8);
+
+        tick++;
+        if (tick == TIMER_HZ) {
+            // Rebase once per second to keep the arithmetic small
+            tick_deadline(&start, tick, &deadline);
+            start = deadline;
+            tick = 0;
+            executed = 0;
+        }
+        tick_deadline(&start, tick, &deadline);
+        if (is_behind(&deadline)) {
+            // Host could not keep up; drop the backlog instead of bursting
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            tick = 0;
+            executed = 0;
+            continue;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                               NULL) == EINTR) {
+        }
+    }
+
+    if (chip8->fault != FAULT_NONE) {
+        printf("Program fault: %s at %03x.\n", fault_name(chip8->fault),
+               chip8->pc);
+    } else {
+        printf("%s\n", "Program execution stuck.");
+    }
+}
+
+unsigned long run_replay(Chip8* chip8, Chip8Core core) {
+    unsigned long frames = 0;
+    unsigned long cycles;
+    while (input_log_frame(chip8->input_log, chip8, &cycles)) {
+        run_tick(chip8, core, cycles);
+        tick_timers(chip8);
+        frames++;
+    }
+    return frames;
+}
@@ -0,0 +1,32 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "chip8machine.h"
+#include "renderer.h"
+#include "rewind.h"
+#include "sampler.h"
+
+#define TIMER_HZ 60
+#define DEFAULT_IPS 700
+
+// Runs the machine in real time: each 60 Hz tick executes that tick's share of
+// ips instructions in one burst, advances the tick count the timers are read
+// against, presents at most one frame and sleeps until the next tick. A burst
+// ends early once the program waits on the delay timer or keypad, as spinning
+// in the wait until the tick is over would leave the machine exactly where it
+// is. Returns when the program parks itself on a jump to its own address or
+// faults. With a rewind buffer, every tick's state is recorded into it, and a
+// sampler sees every instruction the scheduler executes. An input log attached
+// to the machine records each tick's keypad and cycles.
+void run_scheduler(Chip8* chip8,
+                   Chip8Core core,
+                   unsigned long ips,
+                   Renderer* renderer,
+                   Rewind* rewind,
+                   GuestSampler* sampler);
+
+// Runs the ticks of the input log attached to the machine as fast as the
+// host allows, with no display or sleep. Returns the number of ticks run.
+unsigned long run_replay(Chip8* chip8, Chip8Core core);
+
+#endif
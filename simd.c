@@ -0,0 +1,414 @@
+#include "simd.h"
+#include <string.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+static void scalar_step(Chip8Lanes* lanes, unsigned int lane) {
+    // Run one instruction of a lane on the interpreter, with the lane's
+    // registers moved into its machine and back
+    Chip8* chip8 = lanes->machines[lane];
+
+    for (unsigned int r = 0; r < 16; r++) {
+        chip8->v[r] = lanes->v[r][lane];
+    }
+    chip8->I = lanes->I[lane];
+    chip8->pc = lanes->pc[lane];
+    set_delay_timer(chip8, lanes->delay_timer[lane]);
+    set_sound_timer(chip8, lanes->sound_timer[lane]);
+
+    uint16_t instruction = fetch(chip8);
+    decode(instruction, chip8);
+
+    for (unsigned int r = 0; r < 16; r++) {
+        lanes->v[r][lane] = chip8->v[r];
+    }
+    lanes->I[lane] = chip8->I;
+    lanes->pc[lane] = chip8->pc;
+    lanes->delay_timer[lane] = read_delay_timer(chip8);
+    lanes->sound_timer[lane] = read_sound_timer(chip8);
+}
+
+void lanes_init(Chip8Lanes* lanes, Chip8** machines) {
+    lanes->same_code = TRUE;
+    lanes->leader = 0;
+    for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+        Chip8* chip8 = machines[lane];
+        lanes->machines[lane] = chip8;
+        for (unsigned int r = 0; r < 16; r++) {
+            lanes->v[r][lane] = chip8->v[r];
+        }
+        lanes->I[lane] = chip8->I;
+        lanes->pc[lane] = chip8->pc;
+        lanes->delay_timer[lane] = read_delay_timer(chip8);
+        lanes->sound_timer[lane] = read_sound_timer(chip8);
+        lanes->cycles[lane] = 0;
+        if (memcmp(chip8->mem, machines[0]->mem, RAM_SIZE) != 0)
+            lanes->same_code = FALSE;
+    }
+}
+
+void lanes_sync(Chip8Lanes* lanes) {
+    for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+        Chip8* chip8 = lanes->machines[lane];
+        for (unsigned int r = 0; r < 16; r++) {
+            chip8->v[r] = lanes->v[r][lane];
+        }
+        chip8->I = lanes->I[lane];
+        chip8->pc = lanes->pc[lane];
+        set_delay_timer(chip8, lanes->delay_timer[lane]);
+        set_sound_timer(chip8, lanes->sound_timer[lane]);
+    }
+}
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// 16 lanes of 16-bit values: one AVX2 register, or two SSE2 halves
+#if defined(__AVX2__)
+typedef __m256i Vec16;
+
+static Vec16 load16(const uint16_t* p) {
+    return _mm256_loadu_si256((const __m256i*)p);
+}
+
+static void store16(uint16_t* p, Vec16 a) {
+    _mm256_storeu_si256((__m256i*)p, a);
+}
+
+static Vec16 set16(uint16_t value) {
+    return _mm256_set1_epi16((short)value);
+}
+
+static Vec16 add16(Vec16 a, Vec16 b) {
+    return _mm256_add_epi16(a, b);
+}
+
+static Vec16 and16(Vec16 a, Vec16 b) {
+    return _mm256_and_si256(a, b);
+}
+
+static Vec16 blend16(Vec16 mask, Vec16 a, Vec16 b) {
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+// Widen 0x00/0xFF byte masks to 0x0000/0xFFFF
+static Vec16 widen_mask(__m128i mask8) {
+    return _mm256_cvtepi8_epi16(mask8);
+}
+
+static Vec16 zero_extend(__m128i bytes) {
+    return _mm256_cvtepu8_epi16(bytes);
+}
+
+static __m128i equal_mask(Vec16 a, Vec16 b) {
+    __m256i eq = _mm256_cmpeq_epi16(a, b);
+    return _mm_packs_epi16(_mm256_castsi256_si128(eq),
+                           _mm256_extracti128_si256(eq, 1));
+}
+#else
+typedef struct {
+    __m128i lo;
+    __m128i hi;
+} Vec16;
+
+static Vec16 load16(const uint16_t* p) {
+    Vec16 r = {_mm_loadu_si128((const __m128i*)p),
+               _mm_loadu_si128((const __m128i*)(p + 8))};
+    return r;
+}
+
+static void store16(uint16_t* p, Vec16 a) {
+    _mm_storeu_si128((__m128i*)p, a.lo);
+    _mm_storeu_si128((__m128i*)(p + 8), a.hi);
+}
+
+static Vec16 set16(uint16_t value) {
+    Vec16 r = {_mm_set1_epi16((short)value), _mm_set1_epi16((short)value)};
+    return r;
+}
+
+static Vec16 add16(Vec16 a, Vec16 b) {
+    Vec16 r = {_mm_add_epi16(a.lo, b.lo), _mm_add_epi16(a.hi, b.hi)};
+    return r;
+}
+
+static Vec16 and16(Vec16 a, Vec16 b) {
+    Vec16 r = {_mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi)};
+    return r;
+}
+
+static Vec16 blend16(Vec16 mask, Vec16 a, Vec16 b) {
+    Vec16 r = {
+        _mm_or_si128(_mm_and_si128(mask.lo, a.lo),
+                     _mm_andnot_si128(mask.lo, b.lo)),
+        _mm_or_si128(_mm_and_si128(mask.hi, a.hi),
+                     _mm_andnot_si128(mask.hi, b.hi)),
+    };
+    return r;
+}
+
+static Vec16 widen_mask(__m128i mask8) {
+    Vec16 r = {_mm_unpacklo_epi8(mask8, mask8),
+               _mm_unpackhi_epi8(mask8, mask8)};
+    return r;
+}
+
+static Vec16 zero_extend(__m128i bytes) {
+    __m128i zero = _mm_setzero_si128();
+    Vec16 r = {_mm_unpacklo_epi8(bytes, zero),
+               _mm_unpackhi_epi8(bytes, zero)};
+    return r;
+}
+
+static __m128i equal_mask(Vec16 a, Vec16 b) {
+    return _mm_packs_epi16(_mm_cmpeq_epi16(a.lo, b.lo),
+                           _mm_cmpeq_epi16(a.hi, b.hi));
+}
+#endif
+
+// Number of bytes FX33 or FX55 store at I, 0 for everything else
+static unsigned int memory_written(uint16_t instruction) {
+    uint8_t x = (instruction & 0x0F00) >> 8;
+    uint8_t nn = instruction & 0x00FF;
+    if ((instruction >> 12) != 0xF)
+        return 0;
+    if (nn == 0x33)
+        return 3;
+    if (nn == 0x55)
+        return x + 1;
+    return 0;
+}
+
+static int same_bytes(Chip8Lanes* lanes, unsigned int addr, unsigned int len) {
+    if (addr + len > RAM_SIZE)
+        return FALSE;
+    for (unsigned int lane = 1; lane < SIMD_LANES; lane++) {
+        if (memcmp(lanes->machines[lane]->mem + addr,
+                   lanes->machines[0]->mem + addr, len) != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static __m128i load8(const uint8_t* p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+static void store8(uint8_t* p, __m128i a) {
+    _mm_storeu_si128((__m128i*)p, a);
+}
+
+static __m128i blend8(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// vx = mask ? value : vx
+static void write_register(Chip8Lanes* lanes,
+                           uint8_t x,
+                           __m128i mask,
+                           __m128i value) {
+    store8(lanes->v[x], blend8(mask, value, load8(lanes->v[x])));
+}
+
+// pc += 2, or 4 where skip is set, for every lane in mask
+static void advance(Chip8Lanes* lanes, __m128i mask, __m128i skip) {
+    Vec16 step = add16(and16(widen_mask(mask), set16(2)),
+                       and16(widen_mask(_mm_and_si128(mask, skip)), set16(2)));
+    store16(lanes->pc, add16(load16(lanes->pc), step));
+}
+
+static void set_pc(Chip8Lanes* lanes, __m128i mask, uint16_t pc) {
+    store16(lanes->pc, blend16(widen_mask(mask), set16(pc), load16(lanes->pc)));
+}
+
+static void set_index(Chip8Lanes* lanes, __m128i mask, Vec16 value) {
+    store16(lanes->I, blend16(widen_mask(mask), value, load16(lanes->I)));
+}
+
+// Executes the instruction across the lanes in mask. Returns FALSE if it has
+// no vector form, without touching any lane.
+static int vector_step(Chip8Lanes* lanes, uint16_t instruction, __m128i mask) {
+    uint8_t x = (instruction & 0x0F00) >> 8;
+    uint8_t y = (instruction & 0x00F0) >> 4;
+    uint8_t n = instruction & 0x000F;
+    uint8_t nn = instruction & 0x00FF;
+    uint16_t nnn = instruction & 0x0FFF;
+    __m128i none = _mm_setzero_si128();
+    __m128i ones = _mm_cmpeq_epi8(none, none);
+    __m128i vx = load8(lanes->v[x]);
+    __m128i vy = load8(lanes->v[y]);
+
+    switch (instruction >> 12) {
+        case 0x0:
+            if (instruction == 0x00E0 || instruction == 0x00EE)
+                return FALSE;
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0x1:
+            set_pc(lanes, mask, nnn);
+            return TRUE;
+        case 0x3:
+            advance(lanes, mask, _mm_cmpeq_epi8(vx, _mm_set1_epi8((char)nn)));
+            return TRUE;
+        case 0x4:
+            advance(lanes, mask,
+                    _mm_xor_si128(_mm_cmpeq_epi8(vx, _mm_set1_epi8((char)nn)),
+                                  ones));
+            return TRUE;
+        case 0x5:
+            advance(lanes, mask, _mm_cmpeq_epi8(vx, vy));
+            return TRUE;
+        case 0x9:
+            advance(lanes, mask, _mm_xor_si128(_mm_cmpeq_epi8(vx, vy), ones));
+            return TRUE;
+        case 0x6:
+            write_register(lanes, x, mask, _mm_set1_epi8((char)nn));
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0x7:
+            write_register(lanes, x, mask,
+                           _mm_add_epi8(vx, _mm_set1_epi8((char)nn)));
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0x8:
+            switch (n) {
+                case 0x0:
+                    write_register(lanes, x, mask, vy);
+                    break;
+                case 0x1:
+                    write_register(lanes, x, mask, _mm_or_si128(vx, vy));
+                    break;
+                case 0x2:
+                    write_register(lanes, x, mask, _mm_and_si128(vx, vy));
+                    break;
+                case 0x3:
+                    write_register(lanes, x, mask, _mm_xor_si128(vx, vy));
+                    break;
+                case 0x4: {
+                    // Carry where the wrapped sum is below vx
+                    __m128i sum = _mm_add_epi8(vx, vy);
+                    __m128i no_carry =
+                        _mm_cmpeq_epi8(_mm_max_epu8(sum, vx), sum);
+                    __m128i carry = _mm_andnot_si128(no_carry,
+                                                     _mm_set1_epi8(1));
+                    write_register(lanes, 0xF, mask, carry);
+                    write_register(lanes, x, mask, sum);
+                    break;
+                }
+                default:
+                    return FALSE;
+            }
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0xA:
+            set_index(lanes, mask, set16(nnn));
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0xB:
+            set_index(lanes, mask,
+                      add16(zero_extend(load8(lanes->v[0])), set16(nnn)));
+            advance(lanes, mask, none);
+            return TRUE;
+        case 0xF:
+            if (nn != 0x1E)
+                return FALSE;
+            set_index(lanes, mask,
+                      add16(load16(lanes->I), zero_extend(vx)));
+            advance(lanes, mask, none);
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+static void count_cycles(Chip8Lanes* lanes, __m128i mask) {
+    // Subtracting an all-ones mask adds one
+    __m128i m16_lo = _mm_unpacklo_epi8(mask, mask);
+    __m128i m16_hi = _mm_unpackhi_epi8(mask, mask);
+    __m128i m32[4] = {
+        _mm_unpacklo_epi16(m16_lo, m16_lo),
+        _mm_unpackhi_epi16(m16_lo, m16_lo),
+        _mm_unpacklo_epi16(m16_hi, m16_hi),
+        _mm_unpackhi_epi16(m16_hi, m16_hi),
+    };
+    for (unsigned int i = 0; i < 4; i++) {
+        __m128i* p = (__m128i*)(lanes->cycles + i * 4);
+        _mm_storeu_si128(p, _mm_sub_epi32(_mm_loadu_si128(p), m32[i]));
+    }
+}
+
+void run_lanes(Chip8Lanes* lanes, unsigned long steps) {
+    for (unsigned long step = 0; step < steps; step++) {
+        unsigned int leader = lanes->leader;
+        uint16_t pc = lanes->pc[leader];
+        Chip8* chip8 = lanes->machines[leader];
+        __m128i mask = equal_mask(load16(lanes->pc), set16(pc));
+        unsigned int bits = _mm_movemask_epi8(mask);
+
+        if (bits != 0xFFFF) {
+            // Diverged: rotate the leader so every group makes progress
+            lanes->leader = (leader + 1) % SIMD_LANES;
+        }
+        if (pc >= RAM_SIZE - 1) {
+            // Let the interpreter report the bad fetch
+            scalar_step(lanes, leader);
+            lanes->cycles[leader]++;
+            continue;
+        }
+
+        uint16_t instruction =
+            (uint16_t)chip8->mem[pc] << 8 | chip8->mem[pc + 1];
+        if (!lanes->same_code) {
+            uint8_t same[SIMD_LANES];
+            for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+                const unsigned char* mem = lanes->machines[lane]->mem;
+                int match = ((bits >> lane) & 1) &&
+                            mem[pc] == chip8->mem[pc] &&
+                            mem[pc + 1] == chip8->mem[pc + 1];
+                same[lane] = match ? 0xFF : 0x00;
+            }
+            mask = load8(same);
+            bits = _mm_movemask_epi8(mask);
+        }
+
+        if (!vector_step(lanes, instruction, mask)) {
+            uint16_t index[SIMD_LANES];
+            memcpy(index, lanes->I, sizeof(index));
+            for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+                if ((bits >> lane) & 1)
+                    scalar_step(lanes, lane);
+            }
+
+            // Lanes can keep sharing one instruction stream as long as the
+            // stores left every lane's memory identical
+            unsigned int written = memory_written(instruction);
+            for (unsigned int lane = 0; written && lanes->same_code &&
+                                        lane < SIMD_LANES;
+                 lane++) {
+                if (((bits >> lane) & 1) &&
+                    !same_bytes(lanes, index[lane], written))
+                    lanes->same_code = FALSE;
+            }
+        }
+        count_cycles(lanes, mask);
+    }
+}
+
+#else
+
+// No SIMD on this host: step the lanes one after another
+void run_lanes(Chip8Lanes* lanes, unsigned long steps) {
+    for (unsigned int lane = 0; lane < SIMD_LANES; lane++) {
+        for (unsigned long step = 0; step < steps; step++) {
+            scalar_step(lanes, lane);
+        }
+        lanes->cycles[lane] += steps;
+    }
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+#include "chip8machine.h"
+
+#define SIMD_LANES 16
+
+// Register state of SIMD_LANES machines as lane-parallel arrays, so one
+// vector instruction updates a register across every lane. Memory, display
+// and stack stay in each lane's own Chip8, which also carries the registers
+// whenever an instruction has to run on the scalar interpreter.
+typedef struct {
+    uint8_t v[16][SIMD_LANES];
+    uint16_t I[SIMD_LANES];
+    uint16_t pc[SIMD_LANES];
+    uint8_t delay_timer[SIMD_LANES];
+    uint8_t sound_timer[SIMD_LANES];
+    // Instructions each lane has executed
+    uint32_t cycles[SIMD_LANES];
+    Chip8* machines[SIMD_LANES];
+    // All lanes hold the same program bytes, so the leader's instruction is
+    // every lane's instruction at that pc
+    int same_code;
+    // Lane whose pc picks the instruction for the next step
+    unsigned int leader;
+} Chip8Lanes;
+
+// Gathers the registers of machines[0..SIMD_LANES) into lanes
+void lanes_init(Chip8Lanes* lanes, Chip8** machines);
+// Writes the lane registers back into their machines
+void lanes_sync(Chip8Lanes* lanes);
+// Executes steps instructions in lockstep. Every step runs one opcode on all
+// lanes at the leader's pc; lanes elsewhere wait for a later step.
+void run_lanes(Chip8Lanes* lanes, unsigned long steps);
+
+#endif
@@ -0,0 +1,105 @@
+#include "snapshot.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRUE (1 == 1)
+#define FALSE (1 != 1)
+
+static int valid_snapshot(const Chip8Snapshot* snapshot) {
+    if (snapshot->magic != SNAPSHOT_MAGIC ||
+        snapshot->version != SNAPSHOT_VERSION ||
+        snapshot->size != sizeof(Chip8Snapshot) ||
+        snapshot->stack_depth > STACK_SIZE || !valid_pc(snapshot->pc))
+        return FALSE;
+    // Each return address becomes the pc when popped
+    for (unsigned int i = 0; i < snapshot->stack_depth; i++) {
+        if (!valid_pc(snapshot->stack[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+void save_snapshot(Chip8* chip8, Chip8Snapshot* snapshot) {
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->size = sizeof(Chip8Snapshot);
+    snapshot->pc = chip8->pc;
+    snapshot->I = chip8->I;
+    snapshot->rng = chip8->rng;
+    snapshot->keypad = chip8->keypad;
+    memcpy(snapshot->v, chip8->v, sizeof(snapshot->v));
+    snapshot->delay_timer = read_delay_timer(chip8);
+    snapshot->sound_timer = read_sound_timer(chip8);
+    snapshot->fault = chip8->fault;
+    snapshot->stack_depth = chip8->stack.top;
+    memcpy(snapshot->stack, chip8->stack.data, sizeof(snapshot->stack));
+
+    memcpy(snapshot->display, chip8->display_buffer, sizeof(snapshot->display));
+    memcpy(snapshot->mem, chip8->mem, sizeof(snapshot->mem));
+}
+
+int restore_snapshot(Chip8* chip8, const Chip8Snapshot* snapshot) {
+    if (!valid_snapshot(snapshot))
+        return FALSE;
+
+    chip8->pc = snapshot->pc;
+    chip8->I = snapshot->I;
+    chip8->rng = snapshot->rng;
+    chip8->keypad = snapshot->keypad;
+    memcpy(chip8->v, snapshot->v, sizeof(chip8->v));
+    set_delay_timer(chip8, snapshot->delay_timer);
+    set_sound_timer(chip8, snapshot->sound_timer);
+    chip8->fault = snapshot->fault;
+    chip8->stack.top = snapshot->stack_depth;
+    memcpy(chip8->stack.data, snapshot->stack, sizeof(snapshot->stack));
+    memcpy(chip8->display_buffer, snapshot->display,
+           sizeof(chip8->display_buffer));
+
+    // Only drop decoded code if the program bytes actually changed, which is
+    // the common case when rewinding the same ROM over and over
+    if (memcmp(chip8->mem, snapshot->mem, RAM_SIZE) != 0) {
+        memcpy(chip8->mem, snapshot->mem, RAM_SIZE);
+        invalidate_code(chip8, 0, RAM_SIZE);
+    }
+    return TRUE;
+}
+
+int write_snapshot_file(const char* file_name, const Chip8Snapshot* snapshot) {
+    FILE* f = fopen(file_name, "wb");
+    if (!f)
+        return FALSE;
+    size_t written = fwrite(snapshot, sizeof(Chip8Snapshot), 1, f);
+    return fclose(f) == 0 && written == 1;
+}
+
+const Chip8Snapshot* map_snapshot_file(const char* file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != sizeof(Chip8Snapshot)) {
+        close(fd);
+        return NULL;
+    }
+    void* mapping =
+        mmap(NULL, sizeof(Chip8Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const Chip8Snapshot* snapshot = mapping;
+    if (!valid_snapshot(snapshot)) {
+        munmap(mapping, sizeof(Chip8Snapshot));
+        return NULL;
+    }
+    return snapshot;
+}
+
+void unmap_snapshot_file(const Chip8Snapshot* snapshot) {
+    munmap((void*)snapshot, sizeof(Chip8Snapshot));
+}
@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "chip8machine.h"
+
+#define SNAPSHOT_MAGIC 0x53533843  // "C8SS" in a little-endian file
+#define SNAPSHOT_VERSION 3
+
+// Complete machine state as one flat block with no pointers, so it can be
+// copied around freely and a file holding one can be mapped and restored
+// from in place. Fields use host byte order. The size check also rejects
+// snapshots from builds with a different STACK_SIZE.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint16_t pc;
+    uint16_t I;
+    uint64_t rng;
+    uint16_t keypad;
+    uint64_t display[DISPLAY_Y];
+    uint8_t mem[RAM_SIZE];
+    uint8_t v[16];
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t fault;
+    uint8_t stack_depth;
+    uint16_t stack[STACK_SIZE];
+} Chip8Snapshot;
+
+void save_snapshot(Chip8* chip8, Chip8Snapshot* snapshot);
+// Returns FALSE, leaving the machine untouched, if the snapshot is not one
+// this build understands or its pc or return addresses are out of range
+int restore_snapshot(Chip8* chip8, const Chip8Snapshot* snapshot);
+
+int write_snapshot_file(const char* file_name, const Chip8Snapshot* snapshot);
+// Maps a snapshot file read-only. Returns NULL if it cannot be opened or is
+// not a valid snapshot.
+const Chip8Snapshot* map_snapshot_file(const char* file_name);
+void unmap_snapshot_file(const Chip8Snapshot* snapshot);
+
+#endif
@@ -2,19 +2,37 @@
 #define STACK_H
 
 #include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
 
+// Return addresses a machine can hold, fixed at compile time
+#ifndef STACK_SIZE
+#define STACK_SIZE 32
+#endif
+
+// Call stack stored inline in the machine, data[top - 1] being the most
+// recent return address
 typedef struct {
-    uint16_t* data;
-    int top;
-    int capacity;
+    uint16_t data[STACK_SIZE];
+    unsigned int top;
 } Stack;
 
-void stack_init(Stack* s, unsigned int capacity);
-void stack_free(Stack* s);
-void stack_push(Stack* s, uint16_t element);
-uint16_t stack_peak(Stack* s);
-uint16_t stack_pop(Stack* s);
+void stack_init(Stack* s);
+
+// Push and pop return 0 and leave the stack unchanged on overflow or
+// underflow, for the caller to raise as a fault
+static inline int stack_push(Stack* s, uint16_t element) {
+    int ok = s->top < STACK_SIZE;
+    if (ok)
+        s->data[s->top++] = element;
+    return ok;
+}
+
+static inline int stack_pop(Stack* s, uint16_t* element) {
+    int ok = s->top > 0;
+    if (ok)
+        *element = s->data[--s->top];
+    return ok;
+}
+
+int stack_peak(const Stack* s, uint16_t* element);
 
 #endif
@@ -0,0 +1,200 @@
+#include "threaded.h"
+#include "chip8machine.h"
+
+#if defined(__GNUC__)
+
+// Direct-threaded interpreter over the decoded instruction slots. Every
+// handler ends in its own copy of the dispatch, so each opcode gets its own
+// indirect jump for the branch predictor to learn.
+void run_threaded(Chip8* chip8, unsigned long cycles) {
+    static void* const labels[OP_COUNT] = {
+        [OP_DECODE] = &&op_decode,       [OP_NOP] = &&op_nop,
+        [OP_UNHANDLED] = &&op_unhandled, [OP_CLS] = &&op_cls,
+        [OP_RET] = &&op_ret,             [OP_JP] = &&op_jp,
+        [OP_CALL] = &&op_call,           [OP_SE_IMM] = &&op_se_imm,
+        [OP_SNE_IMM] = &&op_sne_imm,     [OP_SE_REG] = &&op_se_reg,
+        [OP_SNE_REG] = &&op_sne_reg,     [OP_LD_IMM] = &&op_ld_imm,
+        [OP_ADD_IMM] = &&op_add_imm,     [OP_LD_REG] = &&op_ld_reg,
+        [OP_OR] = &&op_or,               [OP_AND] = &&op_and,
+        [OP_XOR] = &&op_xor,             [OP_ADD_REG] = &&op_add_reg,
+        [OP_ALU] = &&op_alu,             [OP_LD_I] = &&op_ld_i,
+        [OP_JP_V0] = &&op_jp_v0,         [OP_RND] = &&op_rnd,
+        [OP_DRW] = &&op_drw,             [OP_ADD_I] = &&op_add_i,
+        [OP_MISC] = &&op_misc,           [OP_KEY] = &&op_key,
+        [OP_LD_I_DRW] = &&op_ld_i_drw,   [OP_LD_LD_DRW] = &&op_ld_ld_drw,
+        [OP_ADD_SE_JP] = &&op_add_se_jp, [OP_LD_I_LOAD] = &&op_ld_i_load,
+    };
+    const DecodedInstr* d;
+    unsigned char* v = chip8->v;
+
+#define DISPATCH()                             \
+    do {                                       \
+        if (cycles-- == 0)                     \
+            return;                            \
+        PROFILE_INSTRUCTION(chip8, chip8->pc); \
+        d = &chip8->icache[chip8->pc];         \
+        chip8->pc += 2;                        \
+        goto *labels[d->op];                   \
+    } while (0)
+
+    DISPATCH();
+
+op_decode:
+    if (!icache_fill(chip8, chip8->pc - 2))
+        DISPATCH();
+    goto *labels[d->op];
+op_nop:
+    DISPATCH();
+op_unhandled:
+    // The cached handler knows how to report it
+    d->handler(chip8, d);
+    DISPATCH();
+op_cls:
+    clear_screen(chip8);
+    DISPATCH();
+op_ret: {
+    uint16_t addr;
+    if (stack_pop(&(chip8->stack), &addr)) {
+        chip8->pc = addr;
+    } else {
+        raise_fault(chip8, FAULT_STACK_UNDERFLOW);
+    }
+    DISPATCH();
+}
+op_jp:
+    chip8->pc = d->nnn;
+    DISPATCH();
+op_call:
+    if (stack_push(&(chip8->stack), chip8->pc)) {
+        chip8->pc = d->nnn;
+    } else {
+        raise_fault(chip8, FAULT_STACK_OVERFLOW);
+    }
+    DISPATCH();
+op_se_imm:
+    if (v[d->x] == d->nn)
+        chip8->pc += 2;
+    DISPATCH();
+op_sne_imm:
+    if (v[d->x] != d->nn)
+        chip8->pc += 2;
+    DISPATCH();
+op_se_reg:
+    if (v[d->x] == v[d->y])
+        chip8->pc += 2;
+    DISPATCH();
+op_sne_reg:
+    if (v[d->x] != v[d->y])
+        chip8->pc += 2;
+    DISPATCH();
+op_ld_imm:
+    v[d->x] = d->nn;
+    DISPATCH();
+op_add_imm:
+    v[d->x] += d->nn;
+    DISPATCH();
+op_ld_reg:
+    v[d->x] = v[d->y];
+    DISPATCH();
+op_or:
+    v[d->x] |= v[d->y];
+    DISPATCH();
+op_and:
+    v[d->x] &= v[d->y];
+    DISPATCH();
+op_xor:
+    v[d->x] ^= v[d->y];
+    DISPATCH();
+op_add_reg: {
+    uint16_t result = v[d->x] + v[d->y];
+    v[0xF] = result > 255 ? 1 : 0;
+    v[d->x] = result;
+    DISPATCH();
+}
+op_alu:
+    instruction8_handler(d->x, d->y, d->n, chip8);
+    DISPATCH();
+op_ld_i:
+    chip8->I = d->nnn;
+    DISPATCH();
+op_jp_v0:
+    chip8->I = d->nnn + v[0x0];
+    DISPATCH();
+op_rnd:
+    random_register(chip8, d->x, d->nn);
+    DISPATCH();
+op_drw:
+    draw_sprite(chip8, d->x, d->y, d->n);
+    DISPATCH();
+op_add_i:
+    chip8->I += v[d->x];
+    DISPATCH();
+op_misc:
+    instructionF_handler(d->x, d->nn, chip8);
+    DISPATCH();
+op_key:
+    instructionE_handler(d->x, d->nn, chip8);
+    DISPATCH();
+
+// Fused sequences. The dispatch has charged the first instruction; with too
+// little budget left for the rest, that one runs alone.
+#define FUSED_BUDGET(length)          \
+    if (cycles + 1 < (length)) {      \
+        d->handler(chip8, d);         \
+        DISPATCH();                   \
+    }
+// Charges the instructions after the first, each a dispatch saved
+#define FUSED_CHARGE(op, extra)                      \
+    cycles -= (extra);                               \
+    chip8->fusion_saved[(op) - OP_FUSED_FIRST] += (extra)
+
+op_ld_i_drw:
+    FUSED_BUDGET(2);
+    chip8->I = d->nnn;
+    chip8->pc += 2;
+    draw_sprite(chip8, d[2].x, d[2].y, d[2].n);
+    FUSED_CHARGE(OP_LD_I_DRW, 1);
+    DISPATCH();
+op_ld_ld_drw:
+    FUSED_BUDGET(3);
+    v[d->x] = d->nn;
+    v[d[2].x] = d[2].nn;
+    chip8->pc += 4;
+    draw_sprite(chip8, d[4].x, d[4].y, d[4].n);
+    FUSED_CHARGE(OP_LD_LD_DRW, 2);
+    DISPATCH();
+op_add_se_jp:
+    FUSED_BUDGET(3);
+    v[d->x] += d->nn;
+    if (v[d[2].x] == d[2].nn) {
+        // Loop done: the jump is skipped
+        chip8->pc += 4;
+        FUSED_CHARGE(OP_ADD_SE_JP, 1);
+    } else {
+        chip8->pc = d[4].nnn;
+        FUSED_CHARGE(OP_ADD_SE_JP, 2);
+    }
+    DISPATCH();
+op_ld_i_load:
+    FUSED_BUDGET(2);
+    chip8->I = d->nnn;
+    chip8->pc += 2;
+    load_memory(chip8, d[2].x);
+    FUSED_CHARGE(OP_LD_I_LOAD, 1);
+    DISPATCH();
+
+#undef FUSED_BUDGET
+#undef FUSED_CHARGE
+
+#undef DISPATCH
+}
+
+#else
+
+// Without labels as values the cached core is already the function pointer
+// table version of this loop
+void run_threaded(Chip8* chip8, unsigned long cycles) {
+    run_cached(chip8, cycles);
+}
+
+#endif
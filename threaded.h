@@ -0,0 +1,9 @@
+#ifndef THREADED_H
+#define THREADED_H
+
+struct Chip8;
+
+// Interpreter core using computed-goto dispatch over the decoded slots
+void run_threaded(struct Chip8* chip8, unsigned long cycles);
+
+#endif